@@ -0,0 +1,511 @@
+#!/bin/bash
+# =============================================================================
+# wserver load tests
+# =============================================================================
+# Every benchmark starts its own server on $PORT, out of this directory, and
+# stops it again when done.
+
+SERVER="wserver"
+CLIENT="wclient"
+BENCH="wbench"
+PORT="${PORT:-$((20000 + RANDOM % 10000))}"
+SERVER_PID=""
+DOCROOT=""
+
+
+# == Helpers ===================================================================
+_usage() {
+	command cat <<-EOF
+
+	Usage: ./${0##*/} {pool|sched|idle|parse|static|cache|keepalive|load|cgi|engines|gzip|overload|all}
+
+	pool:  Requests/sec for 8 concurrent 'spin.cgi?1' requests with 1, 2, 4
+	       and 8 worker threads.
+	sched: Mean and p99 latency of small and large static files requested
+	       together, under each scheduling policy.
+	idle:  Server memory and request latency while 10000 idle connections
+	       are held open, with the pool and the epoll engine.
+	parse: read() calls and time to read one request header, a byte per
+	       read() against the buffered reader and the in-place parser,
+	       then the parsing alone on a header already in memory.
+	static: Throughput of one client fetching a 256 MiB file, with the
+	       pool and the epoll engine.
+	cache: Server CPU time for a hot set of small files, with and without
+	       the file cache.
+	keepalive: Latency of back-to-back requests on fresh connections, on
+	       one kept-alive connection, and pipelined 16 deep.
+	load:  wbench regression run: throughput and latency percentiles of a
+	       weighted mix of files, closed and open loop, on both engines.
+	cgi:   Requests/sec for 'spin.cgi?0' with a fork() per request and with
+	       2 persistent CGI workers.
+	engines: The same static workload on the pool, epoll and uring
+	       engines: throughput, latency and server CPU time, with fresh
+	       and kept-alive connections.
+	gzip:  Transfer time of a 256 KiB HTML file to a rate-limited client:
+	       uncompressed, compressed by the server, and precompressed.
+	overload: Goodput and latency at twice the pool's capacity, with no
+	       limits, a queue depth limit and a queue wait limit.
+	all:   Run every benchmark.
+
+	EOF
+}
+
+_print_header() {
+	echo ""
+	echo "================================================="
+	echo "  $1"
+	echo "================================================="
+}
+
+# Current time in nanoseconds.
+_now_ns() {
+	command date +%s%N
+}
+
+# Start the server with the given options and wait until it listens.
+_start_server() {
+	./"$SERVER" -p "$PORT" "$@" > /dev/null &
+	SERVER_PID=$!
+	while ! command ss -ltn "sport = :$PORT" | command grep -q LISTEN; do
+		sleep 0.05
+	done
+}
+
+_stop_server() {
+	kill "$SERVER_PID" 2> /dev/null
+	wait "$SERVER_PID" 2> /dev/null
+}
+
+# Fire <count> requests for <uri> at once, each from its own client, and
+# print how long it took until the last one was answered, in ns.
+_fire() {
+	local count="$1"
+	local uri="$2"
+	local start end
+
+	start=$(_now_ns)
+	for ((i = 0; i < count; i++)); do
+		./"$CLIENT" localhost "$PORT" "$uri" > /dev/null &
+	done
+	wait $(jobs -p | command grep -vx "$SERVER_PID")
+	end=$(_now_ns)
+	echo $((end - start))
+}
+
+# Make a scratch document root with files of the given sizes in KiB, named
+# <size>k.txt.
+_make_docroot() {
+	DOCROOT=$(mktemp -d)
+	for kib in "$@"; do
+		command head -c "$((kib * 1024))" /dev/zero > "$DOCROOT/${kib}k.txt"
+	done
+}
+
+# Request <uri> and append "<label> <seconds>" to <file>.
+_timed_get() {
+	local label="$1"
+	local uri="$2"
+	local file="$3"
+
+	command curl -s -o /dev/null -w "$label %{time_total}\n" "http://localhost:$PORT$uri" >> "$file"
+}
+
+# Open <count> connections to the server and hold them without sending
+# anything until killed. Creates <file> once they are all open.
+_hold_idle() {
+	local count="$1"
+	local ready="$2"
+
+	for ((i = 0; i < count; i++)); do
+		exec {fd}<> "/dev/tcp/localhost/$PORT" || break
+	done
+	: > "$ready"
+	exec sleep infinity
+}
+
+# Print count, mean and p99 of the latencies per label in <file>, in ms.
+_latency_summary() {
+	command sort -k1,1 -k2,2n "$1" | command awk '
+		function report() {
+			if (n) {
+				p = int(n * 0.99 + 0.999)
+				printf "  %-6s %4d requests  mean %9.3f ms  p99 %9.3f ms\n", label, n, sum / n * 1000, v[p] * 1000
+			}
+		}
+		$1 != label { report(); label = $1; n = 0; sum = 0 }
+		{ v[++n] = $2; sum += $2 }
+		END { report() }'
+}
+
+# == Benchmarks ================================================================
+# One slow CGI request no longer holds up the others: with N workers, N of
+# them spin at the same time.
+_bench_pool() {
+	local requests=8
+	local ns
+
+	_print_header "Worker pool (${requests} x spin.cgi?1)"
+	for threads in 1 2 4 8; do
+		_start_server -t "$threads" -b "$requests"
+		ns=$(_fire "$requests" "/spin.cgi?1")
+		_stop_server
+		command awk -v t="$threads" -v n="$requests" -v ns="$ns" 'BEGIN {
+			s = ns / 1e9
+			printf "%2d threads %8.3f s %10.2f requests/sec\n", t, s, n / s
+		}'
+	done
+}
+
+# A burst of small requests arriving right behind a few large ones, served by
+# a single worker so that the order matters.
+_bench_sched() {
+	local small=40
+	local large=4
+	local results
+
+	_print_header "Scheduling (${large} x 32 MiB + ${small} x 4 KiB, 1 worker)"
+	_make_docroot 4 32768
+	results=$(mktemp)
+	for policy in FIFO SFF SRPT; do
+		_start_server -d "$DOCROOT" -t 1 -b 64 -s "$policy"
+		: > "$results"
+		for ((i = 0; i < large; i++)); do
+			_timed_get large "/32768k.txt" "$results" &
+		done
+		sleep 0.05
+		for ((i = 0; i < small; i++)); do
+			_timed_get small "/4k.txt" "$results" &
+		done
+		wait $(jobs -p | command grep -vx "$SERVER_PID")
+		_stop_server
+		echo "$policy"
+		_latency_summary "$results"
+	done
+	rm -rf "$DOCROOT" "$results"
+}
+
+# Idle keep-alive connections tie up a pool worker each, but only a few
+# hundred bytes in the epoll engine.
+_bench_idle() {
+	local idle=10000
+	local requests=50
+	local ready results holder open rss
+
+	_print_header "Idle connections (${idle} held open, ${requests} requests)"
+	_make_docroot 4
+	ready=$(mktemp -u)
+	results=$(mktemp)
+	for engine in pool epoll; do
+		if [ "$engine" = "pool" ]; then
+			_start_server -d "$DOCROOT" -t 8 -b 64
+		else
+			_start_server -d "$DOCROOT" -e epoll
+		fi
+		_hold_idle "$idle" "$ready" &
+		holder=$!
+		# the pool stops accepting once its workers and buffer are taken
+		for ((i = 0; i < 100; i++)); do
+			[ -e "$ready" ] && break
+			sleep 0.1
+		done
+		open=$(command ss -Htn state established "sport = :$PORT" | command wc -l)
+		rss=$(command awk '/VmRSS/ { print $2 }' "/proc/$SERVER_PID/status")
+		: > "$results"
+		for ((i = 0; i < requests; i++)); do
+			command curl -s -o /dev/null --max-time 2 -w "%{http_code} %{time_total}\n" \
+				"http://localhost:$PORT/4k.txt" >> "$results" &
+		done
+		wait $(jobs -p | command grep -vx "$SERVER_PID\|$holder")
+		kill "$holder" 2> /dev/null
+		wait "$holder" 2> /dev/null
+		_stop_server
+		rm -f "$ready"
+		command awk -v e="$engine" -v o="$open" -v r="$rss" -v n="$requests" '
+			$1 == 200 { ok++; sum += $2 }
+			END {
+				printf "%-6s %6d open %8d KiB RSS %4d/%d served", e, o, r, ok, n
+				if (ok)
+					printf "  mean %8.3f ms", sum / ok * 1000
+				printf "\n"
+			}' "$results"
+	done
+	rm -rf "$DOCROOT" "$results"
+}
+
+# Reading a request header without a server or network in the way.
+_bench_parse() {
+	_print_header "Request header parsing"
+	./parsebench
+}
+
+# Large file throughput, where the cost is in moving the body.
+_bench_static() {
+	local fetches=8
+	local bytes=$((256 * 1024 * 1024))
+	local start end cpu
+
+	_print_header "Static file throughput (${fetches} x 256 MiB, 1 client)"
+	_make_docroot 262144
+	for engine in pool epoll; do
+		_start_server -d "$DOCROOT" -e "$engine" -t 1
+		start=$(_now_ns)
+		for ((i = 0; i < fetches; i++)); do
+			command curl -s -o /dev/null "http://localhost:$PORT/262144k.txt"
+		done
+		end=$(_now_ns)
+		# utime + stime, in clock ticks
+		cpu=$(command awk '{ print $14 + $15 }' "/proc/$SERVER_PID/stat")
+		_stop_server
+		command awk -v e="$engine" -v n="$fetches" -v b="$bytes" -v ns="$((end - start))" \
+			-v cpu="$cpu" -v hz="$(command getconf CLK_TCK)" 'BEGIN {
+			s = ns / 1e9
+			printf "%-6s %8.3f s %10.1f MiB/s %8.3f s server CPU\n", e, s, n * b / s / 1048576, cpu / hz
+		}'
+	done
+	rm -rf "$DOCROOT"
+}
+
+# Many requests for a few small files: the cache saves the open(), read and
+# close() of each one.
+_bench_cache() {
+	local rounds=500
+	local files=16
+	local urls=()
+	local start end cpu
+
+	_print_header "File cache (${rounds} x ${files} files of 1-${files} KiB, 1 client)"
+	_make_docroot $(seq "$files")
+	for ((i = 0; i < rounds; i++)); do
+		for ((k = 1; k <= files; k++)); do
+			urls+=("http://localhost:$PORT/${k}k.txt")
+		done
+	done
+	for engine in pool epoll; do
+		for cache in 0 1024; do
+			_start_server -d "$DOCROOT" -e "$engine" -t 1 -c "$cache"
+			start=$(_now_ns)
+			command curl -s "${urls[@]}" > /dev/null
+			end=$(_now_ns)
+			cpu=$(command awk '{ print $14 + $15 }' "/proc/$SERVER_PID/stat")
+			printf "%-6s -c %-5s" "$engine" "$cache"
+			command awk -v n="${#urls[@]}" -v ns="$((end - start))" \
+				-v cpu="$cpu" -v hz="$(command getconf CLK_TCK)" 'BEGIN {
+				printf "%8.3f s %8.1f requests/sec %8.3f s server CPU   ", ns / 1e9, n / (ns / 1e9), cpu / hz
+			}'
+			kill -USR1 "$SERVER_PID"
+			sleep 0.1
+			_stop_server
+		done 2>&1
+	done
+	rm -rf "$DOCROOT"
+}
+
+# A request that reuses its connection skips the TCP handshake and teardown.
+_bench_keepalive() {
+	local requests=2000
+
+	_print_header "Keep-alive (${requests} x 4 KiB, 1 client)"
+	_make_docroot 4
+	for engine in pool epoll; do
+		_start_server -d "$DOCROOT" -e "$engine" -t 1
+		printf "%-6s %-10s " "$engine" "close"
+		./"$CLIENT" -n "$requests" localhost "$PORT" /4k.txt
+		printf "%-6s %-10s " "$engine" "keep-alive"
+		./"$CLIENT" -n "$requests" -k localhost "$PORT" /4k.txt
+		printf "%-6s %-10s " "$engine" "pipelined"
+		./"$CLIENT" -n "$requests" -k -P 16 localhost "$PORT" /4k.txt
+		_stop_server
+	done
+	rm -rf "$DOCROOT"
+}
+
+# The numbers to compare before and after a performance change.
+_bench_load() {
+	local seconds=3
+	local uris
+
+	_print_header "Load (4 threads, ${seconds} s per run)"
+	_make_docroot 1 4 64 1024
+	uris="$DOCROOT/uris"
+	command cat > "$uris" <<-EOF
+	/1k.txt 50
+	/4k.txt 35
+	/64k.txt 14
+	/1024k.txt 1
+	EOF
+	for engine in pool epoll; do
+		_start_server -d "$DOCROOT" -e "$engine" -t 4 -b 16
+		echo "$engine"
+		./"$BENCH" -t 4 -d "$seconds" localhost "$PORT" "$uris"
+		./"$BENCH" -t 4 -d "$seconds" -k localhost "$PORT" "$uris"
+		./"$BENCH" -t 4 -d "$seconds" -k -r 2000 localhost "$PORT" "$uris"
+		_stop_server
+	done
+	rm -rf "$DOCROOT"
+}
+
+# A CGI program that does next to nothing: what is left is the cost of
+# starting it.
+_bench_cgi() {
+	local seconds=3
+	local uris
+
+	_print_header "CGI (4 threads x spin.cgi?0, ${seconds} s per run)"
+	uris=$(mktemp)
+	echo "/spin.cgi?0" > "$uris"
+	for workers in 0 2; do
+		_start_server -t 4 -b 16 -w "$workers"
+		echo "-w $workers"
+		./"$BENCH" -t 4 -d "$seconds" localhost "$PORT" "$uris"
+		_stop_server
+	done
+	rm -f "$uris"
+}
+
+# Blocking calls, readiness and completions side by side, on one thread each.
+_bench_engines() {
+	local seconds=3
+	local uris cpu
+
+	_print_header "Engines (4 clients, 4-64 KiB files, 1 server thread, ${seconds} s per run)"
+	_make_docroot 4 16 64
+	uris="$DOCROOT/uris"
+	command cat > "$uris" <<-EOF
+	/4k.txt 60
+	/16k.txt 30
+	/64k.txt 10
+	EOF
+	for engine in pool epoll uring; do
+		for mode in close keep-alive; do
+			_start_server -d "$DOCROOT" -e "$engine" -t 1 -b 16
+			printf "%-6s %-10s" "$engine" "$mode"
+			if [ "$mode" = "close" ]; then
+				./"$BENCH" -t 4 -d "$seconds" localhost "$PORT" "$uris"
+			else
+				./"$BENCH" -t 4 -d "$seconds" -k localhost "$PORT" "$uris"
+			fi | command awk '
+				/requests\/sec/ { printf " %10.1f requests/sec", $5 }
+				/p50/ { printf "  p50 %s ms  p99 %s ms", $2, $8 }'
+			cpu=$(command awk '{ print $14 + $15 }' "/proc/$SERVER_PID/stat")
+			command awk -v cpu="$cpu" -v hz="$(command getconf CLK_TCK)" \
+				'BEGIN { printf "  server CPU %.2f s\n", cpu / hz }'
+			_stop_server
+		done
+	done
+	rm -rf "$DOCROOT"
+}
+
+# A client on a slow link waits for bytes: a compressed text file reaches it
+# sooner, whether compressed ahead of time or by the server once and cached.
+_bench_gzip() {
+	local requests=20
+	local rate="1M"
+	local url
+
+	_print_header "gzip (${requests} x 256 KiB of HTML, 1 client at ${rate}B/s)"
+	DOCROOT=$(mktemp -d)
+	for ((i = 0; i < 6000; i++)); do
+		echo "<tr><td>$i</td><td>row $((i * 7919 % 10007))</td><td>ok</td></tr>"
+	done | command head -c 262144 > "$DOCROOT/page.html"
+	command cp "$DOCROOT/page.html" "$DOCROOT/pre.html"
+	command gzip -k -9 "$DOCROOT/pre.html"
+	url="http://localhost:$PORT"
+	for mode in identity cached precompressed; do
+		case "$mode" in
+			identity) _start_server -d "$DOCROOT" -c 0 ; set -- "$url/page.html" ;;
+			cached) _start_server -d "$DOCROOT" -c 4096 ; set -- "$url/page.html" --compressed ;;
+			precompressed) _start_server -d "$DOCROOT" -c 0 ; set -- "$url/pre.html" --compressed ;;
+		esac
+		for ((i = 0; i < requests; i++)); do
+			command curl -s -o /dev/null --limit-rate "$rate" -w "%{size_download} %{time_total}\n" "$@"
+		done | command awk -v mode="$mode" '
+			{ bytes += $1; t += $2 }
+			END { printf "%-14s %8d bytes per response %9.3f ms mean\n", mode, bytes / NR, t / NR * 1000 }'
+		_stop_server
+	done
+	rm -rf "$DOCROOT"
+}
+
+# Twice as many requests as the pool can serve: without limits they all
+# queue and every one is late; with a limit on the queue's depth or its
+# wait, the excess gets a 503 at once and the rest are served in time.
+_bench_overload() {
+	local seconds=5
+	local workers=4
+	local service=0.05
+	local rate=$((2 * workers * 20))  # a worker serves 1 / service = 20 a second
+	local uris
+
+	_print_header "Overload (${rate} requests/sec of spin.cgi?${service}, ${workers} workers, ${seconds} s)"
+	uris=$(mktemp)
+	echo "/spin.cgi?${service}" > "$uris"
+	for limits in "" "-q 8" "-l 100"; do
+		_start_server -t "$workers" -b 512 $limits
+		echo "limits: ${limits:-none}"
+		./"$BENCH" -t 256 -d "$seconds" -r "$rate" localhost "$PORT" "$uris"
+		_stop_server
+	done
+	rm -f "$uris"
+}
+
+# =============================================================================
+# MAIN ENTRY POINT
+# =============================================================================
+command make "$SERVER" "$CLIENT" "$BENCH" spin.cgi parsebench > /dev/null || exit 1
+
+case "$1" in
+	"pool")
+		_bench_pool
+		;;
+	"sched")
+		_bench_sched
+		;;
+	"idle")
+		_bench_idle
+		;;
+	"parse")
+		_bench_parse
+		;;
+	"static")
+		_bench_static
+		;;
+	"cache")
+		_bench_cache
+		;;
+	"keepalive")
+		_bench_keepalive
+		;;
+	"load")
+		_bench_load
+		;;
+	"cgi")
+		_bench_cgi
+		;;
+	"engines")
+		_bench_engines
+		;;
+	"gzip")
+		_bench_gzip
+		;;
+	"overload")
+		_bench_overload
+		;;
+	"all")
+		_bench_pool
+		_bench_sched
+		_bench_idle
+		_bench_parse
+		_bench_static
+		_bench_cache
+		_bench_keepalive
+		_bench_load
+		_bench_cgi
+		_bench_engines
+		_bench_gzip
+		_bench_overload
+		;;
+	*)
+		_usage
+		exit 1
+		;;
+esac
@@ -0,0 +1,236 @@
+#include <zlib.h>
+#include "io_helper.h"
+#include "request.h"
+#include "cache.h"
+
+#define MAXBUF (8192)
+
+//
+// Entries live in a chained hash table keyed by path, and on a recency list
+// that eviction takes from the tail. One lock guards both; files are read
+// outside it.
+//
+// An entry that is evicted or found stale while a response is still being
+// sent from it leaves the table at once, but is only freed by the last
+// cache_put().
+//
+// A file may have two entries, told apart by their gzip flag: its bytes as
+// they are, and compressed for clients that accept gzip. Compressing is
+// worth keeping even when caching is off, so the compressed entries then
+// have CACHE_GZIP_CAPACITY bytes to themselves.
+//
+
+#define CACHE_BUCKETS (4096)
+#define CACHE_GZIP_CAPACITY (4 << 20)
+
+static cache_entry_t *table[CACHE_BUCKETS];
+static cache_entry_t lru = { .prev = &lru, .next = &lru };
+static size_t capacity = 0;        // 0: caching is off
+static size_t used = 0;
+static long hits = 0, misses = 0, evictions = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int cache_hash(char *path) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    while (*path)
+	h = (h ^ (unsigned char) *path++) * 16777619u;
+    return h % CACHE_BUCKETS;
+}
+
+static int cache_fresh(cache_entry_t *e, struct stat *sbuf) {
+    return e->dev == sbuf->st_dev && e->ino == sbuf->st_ino && e->file_size == sbuf->st_size &&
+	e->mtime.tv_sec == sbuf->st_mtim.tv_sec && e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+}
+
+static void cache_free(cache_entry_t *e) {
+    free(e->path);
+    free(e->body);
+    free(e);
+}
+
+// Takes an entry out of the table; called with the lock held
+static void cache_remove(cache_entry_t *e) {
+    cache_entry_t **pp = &table[cache_hash(e->path)];
+    while (*pp != e)
+	pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->cached = 0;
+    used -= e->size;
+    if (e->refs == 0)
+	cache_free(e);
+}
+
+// The bytes that entries of this kind may take
+static size_t cache_capacity(int gzip) {
+    return capacity == 0 && gzip ? CACHE_GZIP_CAPACITY : capacity;
+}
+
+static void cache_push(cache_entry_t *e) {
+    e->prev = &lru;
+    e->next = lru.next;
+    lru.next->prev = e;
+    lru.next = e;
+}
+
+//
+// Replaces the body with its gzip compression, or with nothing if that is
+// no smaller. Either way the work is done once per version of the file.
+//
+static void cache_compress(cache_entry_t *e) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 16 more bits of window: a gzip wrapper rather than a zlib one
+    assert(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    uLong bound = deflateBound(&z, e->size);
+    char *out = malloc(bound);
+    assert(out != NULL);
+    z.next_in = (Bytef *) e->body;
+    z.avail_in = e->size;
+    z.next_out = (Bytef *) out;
+    z.avail_out = bound;
+    int rc = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+
+    free(e->body);
+    if (rc != Z_STREAM_END || z.total_out >= e->size) {
+	free(out);
+	e->body = NULL;
+	e->size = 0;
+	return;
+    }
+    e->body = out;
+    e->size = z.total_out;
+}
+
+//
+// Reads the whole file into a new entry, compressing it if asked to, or
+// returns NULL if it is not the file sbuf describes any more
+//
+static cache_entry_t *cache_load(char *filename, struct stat *sbuf, int gzip) {
+    char filetype[MAXBUF];
+    struct stat now;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+	return NULL;
+    cache_entry_t *e = calloc(1, sizeof(cache_entry_t));
+    assert(e != NULL);
+    e->body = malloc(sbuf->st_size > 0 ? sbuf->st_size : 1);
+    e->path = strdup(filename);
+    assert(e->body != NULL && e->path != NULL);
+
+    off_t n = 0;
+    ssize_t rc = 1;
+    while (n < sbuf->st_size && (rc = pread(fd, e->body + n, sbuf->st_size - n, n)) > 0)
+	n += rc;
+    fstat_or_die(fd, &now);
+    close_or_die(fd);
+
+    e->dev = now.st_dev;
+    e->ino = now.st_ino;
+    e->size = e->file_size = now.st_size;
+    e->mtime = now.st_mtim;
+    if (n != sbuf->st_size || !cache_fresh(e, sbuf)) {
+	cache_free(e);
+	return NULL;
+    }
+    if ((e->gzip = gzip))
+	cache_compress(e);
+    request_get_filetype(filename, filetype);
+    e->header_len = snprintf(e->header, sizeof(e->header), ""
+			     "Content-Length: %lld\r\n"
+			     "Content-Type: %s\r\n",
+			     (long long) e->size, filetype);
+    return e;
+}
+
+void cache_init(size_t size) {
+    capacity = size;
+}
+
+//
+// Returns the entry for filename as sbuf describes it, compressed with gzip
+// if asked to, loading it on a miss; the caller sends from it and then hands
+// it back with cache_put(). Returns NULL when caching is off or the file is
+// too large to cache.
+//
+static cache_entry_t *cache_lookup(char *filename, struct stat *sbuf, int gzip) {
+    cache_entry_t *e, *loaded;
+    size_t limit = cache_capacity(gzip);
+
+    // one file may take at most an eighth of the cache
+    if (limit == 0 || sbuf->st_size > limit / 8)
+	return NULL;
+
+    pthread_mutex_lock_or_die(&lock);
+    for (e = table[cache_hash(filename)]; e; e = e->hnext)
+	if (e->gzip == gzip && !strcmp(e->path, filename))
+	    break;
+    if (e && cache_fresh(e, sbuf)) {
+	hits++;
+	e->refs++;
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	cache_push(e);
+	pthread_mutex_unlock_or_die(&lock);
+	return e;
+    }
+    misses++;
+    if (e)
+	cache_remove(e);
+    pthread_mutex_unlock_or_die(&lock);
+
+    if ((loaded = cache_load(filename, sbuf, gzip)) == NULL)
+	return NULL;
+
+    pthread_mutex_lock_or_die(&lock);
+    // someone else may have loaded it meanwhile
+    for (e = table[cache_hash(filename)]; e; e = e->hnext)
+	if (e->gzip == gzip && !strcmp(e->path, filename))
+	    break;
+    if (e)
+	cache_remove(e);
+    e = loaded;
+    while (used + e->size > limit && lru.prev != &lru) {
+	evictions++;
+	cache_remove(lru.prev);
+    }
+    e->hnext = table[cache_hash(filename)];
+    table[cache_hash(filename)] = e;
+    cache_push(e);
+    e->cached = 1;
+    e->refs = 1;
+    used += e->size;
+    pthread_mutex_unlock_or_die(&lock);
+    return e;
+}
+
+cache_entry_t *cache_get(char *filename, struct stat *sbuf) {
+    return cache_lookup(filename, sbuf, 0);
+}
+
+//
+// The same for the file compressed with gzip, which is cached even when
+// caching is off. An entry without a body says that compression does not
+// pay for this file: send it as it is.
+//
+cache_entry_t *cache_get_gzip(char *filename, struct stat *sbuf) {
+    return cache_lookup(filename, sbuf, 1);
+}
+
+void cache_put(cache_entry_t *e) {
+    pthread_mutex_lock_or_die(&lock);
+    if (--e->refs == 0 && !e->cached)
+	cache_free(e);
+    pthread_mutex_unlock_or_die(&lock);
+}
+
+void cache_report(FILE *out) {
+    pthread_mutex_lock_or_die(&lock);
+    fprintf(out, "cache: %ld hits %ld misses %ld evictions, %zu of %zu bytes used\n",
+	    hits, misses, evictions, used, cache_capacity(1));
+    pthread_mutex_unlock_or_die(&lock);
+}
@@ -0,0 +1,36 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+// An in-memory cache of small static files, bounded in bytes and evicting the
+// least recently used. An entry holds the body and its pre-rendered
+// Content-Length and Content-Type lines; it is checked against a fresh stat()
+// of the file on every lookup, and reloaded when the inode, size or mtime
+// changed. A text file may also be kept gzip-compressed, in an entry of its
+// own; those are kept, in a few MiB, even when caching is otherwise off.
+typedef struct cache_entry {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t file_size;
+    struct timespec mtime;
+    int gzip;                      // body is the file compressed
+    off_t size;                    // of the body
+    char header[256];              // "Content-Length: ...\r\nContent-Type: ...\r\n"
+    int header_len;
+    char *body;
+    int refs;                      // lookups not yet released
+    int cached;                    // still in the table
+    struct cache_entry *hnext;     // hash chain
+    struct cache_entry *prev, *next; // recency list, most recent first
+} cache_entry_t;
+
+void cache_init(size_t capacity);
+cache_entry_t *cache_get(char *filename, struct stat *sbuf);
+cache_entry_t *cache_get_gzip(char *filename, struct stat *sbuf);
+void cache_put(cache_entry_t *e);
+void cache_report(FILE *out);
+
+#endif // __CACHE_H__
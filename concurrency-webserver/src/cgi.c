@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include "io_helper.h"
+#include "cgi.h"
+
+#define MAXBUF (8192)
+
+// how long a new worker has to say it is ready
+#define CGI_READY_TIMEOUT_MS (1000)
+
+//
+// Each program has a fixed array of worker slots, started on demand. A
+// request takes an idle worker, or waits on the program's condition
+// variable while all of them are busy, and holds it until the worker says
+// it is done, much as request_serve_dynamic() waits for its child. A slot
+// being started is marked so under the lock; the fork and the wait for the
+// worker to be ready happen without it, so that one slow program does not
+// hold up requests for the others.
+//
+// A program that does not say it is ready when started, or whose worker
+// dies without answering a request, is not made a worker again: from then
+// on it is run the usual way.
+//
+
+typedef struct {
+    pid_t pid;                     // 0: slot not started
+    int sock;                      // our end of the worker's stdin
+    int busy;
+    int starting;                  // being started, without the lock
+} cgi_worker_t;
+
+typedef struct cgi_program {
+    char *path;
+    cgi_worker_t *workers;
+    pthread_cond_t idle;
+    int plain;                     // does not speak the protocol
+    struct cgi_program *next;
+} cgi_program_t;
+
+static int max_workers = 0;        // 0: fork and execve per request
+static cgi_program_t *programs = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cgi_init(int workers) {
+    max_workers = workers;
+}
+
+static void cgi_kill(cgi_worker_t *w) {
+    close_or_die(w->sock);
+    kill(w->pid, SIGKILL);
+    waitpid_or_die(w->pid, NULL, 0);
+    w->pid = 0;
+}
+
+//
+// Start a worker of the program at path into w, which no other thread sees
+// yet, and wait for it to say it is ready. Called without the lock. The
+// environment is put together before the fork: until it execs, the child of
+// a threaded process may only make async-signal-safe calls.
+//
+static int cgi_spawn(char *path, cgi_worker_t *w) {
+    extern char **environ;
+    char *argv[] = { NULL }, ready;
+    int sv[2], n = 0, j = 1, null_fd;
+
+    if ((null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0)
+	return -1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+	close_or_die(null_fd);
+	return -1;
+    }
+    while (environ[n])
+	n++;
+    char **envp = malloc((n + 2) * sizeof(char *));
+    assert(envp != NULL);
+    envp[0] = "CGI_PERSISTENT=1";
+    for (int i = 0; i < n; i++)
+	if (strncmp(environ[i], "CGI_PERSISTENT=", 15))
+	    envp[j++] = environ[i];
+    envp[j] = NULL;
+
+    pid_t pid = fork_or_die();
+    if (pid == 0) {
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	signal(SIGPIPE, SIG_DFL);
+	// the worker outlives the request that started it: it must not keep
+	// that connection, or any other, open. Between requests its output
+	// goes nowhere, not to the server's terminal.
+	if (dup2(sv[1], STDIN_FILENO) >= 0 && dup2(null_fd, STDOUT_FILENO) >= 0 &&
+	    close_range(3, ~0U, 0) == 0)
+	    execve(path, argv, envp);
+	_exit(1);
+    }
+    free(envp);
+    close_or_die(null_fd);
+    close_or_die(sv[1]);
+    w->pid = pid;
+    w->sock = sv[0];
+
+    // a program that does not know the protocol exits, or keeps quiet
+    struct pollfd pfd = { sv[0], POLLIN, 0 };
+    if (poll(&pfd, 1, CGI_READY_TIMEOUT_MS) != 1 || read(sv[0], &ready, 1) != 1) {
+	cgi_kill(w);
+	return -1;
+    }
+    return 0;
+}
+
+//
+// Take an idle worker of the program, starting one if a slot is free.
+// Returns NULL if none could be started, or the program is run the usual
+// way.
+//
+static cgi_worker_t *cgi_get(char *filename) {
+    cgi_program_t *p;
+
+    pthread_mutex_lock_or_die(&lock);
+    for (p = programs; p; p = p->next)
+	if (!strcmp(p->path, filename))
+	    break;
+    if (p == NULL) {
+	p = calloc(1, sizeof(cgi_program_t));
+	assert(p != NULL);
+	p->path = strdup(filename);
+	p->workers = calloc(max_workers, sizeof(cgi_worker_t));
+	assert(p->path != NULL && p->workers != NULL);
+	pthread_cond_init(&p->idle, NULL);
+	p->next = programs;
+	programs = p;
+    }
+    while (1) {
+	cgi_worker_t *unstarted = NULL;
+	if (p->plain) {
+	    pthread_mutex_unlock_or_die(&lock);
+	    return NULL;
+	}
+	for (int i = 0; i < max_workers; i++) {
+	    cgi_worker_t *w = &p->workers[i];
+	    if (w->pid && !w->busy) {
+		w->busy = 1;
+		pthread_mutex_unlock_or_die(&lock);
+		return w;
+	    }
+	    if (!w->pid && !w->starting && !unstarted)
+		unstarted = w;
+	}
+	if (unstarted) {
+	    cgi_worker_t started = { 0 };
+	    unstarted->starting = 1;
+	    pthread_mutex_unlock_or_die(&lock);
+	    int rc = cgi_spawn(p->path, &started);
+	    pthread_mutex_lock_or_die(&lock);
+	    if (rc == 0) {
+		*unstarted = started;
+		unstarted->busy = 1;
+	    } else {
+		unstarted->starting = 0;
+		p->plain = 1;
+		// the waiters may have to find out that there will be no worker
+		pthread_cond_broadcast_or_die(&p->idle);
+	    }
+	    pthread_mutex_unlock_or_die(&lock);
+	    return rc == 0 ? unstarted : NULL;
+	}
+	pthread_cond_wait_or_die(&p->idle, &lock);
+    }
+}
+
+static void cgi_put(char *filename, cgi_worker_t *w, int failed) {
+    cgi_program_t *p;
+
+    pthread_mutex_lock_or_die(&lock);
+    for (p = programs; p; p = p->next)
+	if (!strcmp(p->path, filename))
+	    break;
+    if (failed) {
+	cgi_kill(w);
+	p->plain = 1;
+    }
+    w->busy = 0;
+    // the waiters may have to find out that there will be no worker
+    pthread_cond_broadcast_or_die(&p->idle);
+    pthread_mutex_unlock_or_die(&lock);
+}
+
+//
+// Hand the connection to a worker of the program, after the status line,
+// and wait until it has answered. Returns -1, with nothing sent to the
+// client, when persistent workers are off or none could take the request:
+// the caller then runs the program the usual way. A worker that dies once
+// it has the request may have sent part of a response; that one cannot be
+// taken back, but the program is not made a worker again.
+//
+int cgi_serve(int fd, char *filename, char *cgiargs, char *status) {
+    char ctl[CMSG_SPACE(sizeof(int))], done;
+    struct iovec iov = { cgiargs, strlen(cgiargs) + 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    cgi_worker_t *w;
+
+    if (max_workers == 0 || (w = cgi_get(filename)) == NULL)
+	return -1;
+
+    memset(ctl, 0, sizeof(ctl));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    // a worker that died since its last request reads as end of file:
+    // nothing has gone to the client yet, and the request may go elsewhere
+    if (recv(w->sock, &done, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+	cgi_put(filename, w, 1);
+	return -1;
+    }
+    // the client may have hung up already: the worker then has nothing to do
+    if (write(fd, status, strlen(status)) < 0) {
+	cgi_put(filename, w, 0);
+	return 0;
+    }
+    int failed = sendmsg(w->sock, &msg, MSG_NOSIGNAL) < 0 || read(w->sock, &done, 1) != 1;
+    cgi_put(filename, w, failed);
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+// Persistent CGI workers, in the spirit of FastCGI. Instead of a fork() and
+// execve() per request, each CGI program is started up to 'workers' times
+// with CGI_PERSISTENT=1 in its environment and then kept running. Its stdin
+// is a Unix SOCK_SEQPACKET socket on which every message is one request: the
+// QUERY_STRING as data, and the client's connection attached (SCM_RIGHTS).
+// The program writes the rest of the response to that connection, closes
+// it, and answers with a one-byte message before it takes the next request.
+// It sends one such message when it starts, to say it knows the protocol;
+// a program that does not is run the usual way instead.
+void cgi_init(int workers);
+int cgi_serve(int fd, char *filename, char *cgiargs, char *status);
+
+#endif // __CGI_H__
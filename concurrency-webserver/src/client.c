@@ -0,0 +1,70 @@
+#include <time.h>
+#include "client.h"
+
+#define MAXBUF (8192)
+
+//
+// Send an HTTP request for the specified file, 'count' times over in a
+// single write (pipelined). Returns -1 if the connection failed.
+//
+int client_send(int fd, char *host, char *filename, int keep_alive, int count) {
+    char buf[MAXBUF];
+    
+    /* Form and send the HTTP request */
+    // without keep-alive, the body is read until EOF
+    int len = snprintf(buf, MAXBUF, ""
+		       "GET %s HTTP/1.1\n"
+		       "host: %s\n"
+		       "connection: %s\n\r\n",
+		       filename, host, keep_alive ? "keep-alive" : "close");
+    
+    char *batch = malloc(len * count);
+    assert(batch != NULL);
+    for (int i = 0; i < count; i++)
+	memcpy(batch + i * len, buf, len);
+    ssize_t n = write(fd, batch, len * count);
+    free(batch);
+    return n == len * count ? 0 : -1;
+}
+
+//
+// Read one HTTP response and throw it away, keeping its status code. Returns
+// 1 if the connection stays open for another request, 0 if the server closes
+// it, -1 if it failed before the response was complete.
+//
+int client_discard(rio_t *rp, int *status) {
+    char buf[MAXBUF];
+    long length = -1;
+    ssize_t n;
+    
+    if (readline(rp, buf, MAXBUF) <= 0 || sscanf(buf, "%*s %d", status) != 1)
+	return -1;
+    int keep_alive = !strncmp(buf, "HTTP/1.1", 8);
+    while ((n = readline(rp, buf, MAXBUF)) > 0 && strcmp(buf, "\r\n")) {
+	if (!strncasecmp(buf, "Content-Length:", 15))
+	    length = atol(buf + 15);
+	else if (!strncasecmp(buf, "Connection:", 11))
+	    keep_alive = !strstr(buf, "close");
+    }
+    if (n <= 0)
+	return -1;
+    
+    // no length: the body ends with the connection
+    if (length < 0) {
+	while ((n = readn(rp, buf, MAXBUF)) > 0)
+	    ;
+	return n < 0 ? -1 : 0;
+    }
+    while (length > 0) {
+	if ((n = readn(rp, buf, length < MAXBUF ? length : MAXBUF)) <= 0)
+	    return -1;
+	length -= n;
+    }
+    return keep_alive;
+}
+
+double client_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,11 @@
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+#include "io_helper.h"
+
+// The HTTP client side shared by wclient and wbench
+int client_send(int fd, char *host, char *filename, int keep_alive, int count);
+int client_discard(rio_t *rp, int *status);
+double client_now(void);
+
+#endif // __CLIENT_H__
@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include "io_helper.h"
+#include "request.h"
+#include "event.h"
+#include "cache.h"
+#include "stats.h"
+
+#define MAXBUF (8192)
+
+//
+// The event engine: instead of a thread per connection, each loop thread
+// owns a listening socket on the shared port (SO_REUSEPORT) and an epoll
+// instance, and drives all of its connections through non-blocking,
+// edge-triggered I/O. A connection reads until it has a whole request
+// header, answers it, and on keep-alive goes back to reading the next one,
+// which may already be in its buffer (pipelining).
+//
+// An idle connection only costs its conn_t: the request and response
+// buffers are allocated when bytes arrive, and freed again once everything
+// buffered has been answered.
+//
+
+#define EVENT_BATCH (256)          // events taken per epoll_wait()
+#define EVENT_IDLE_TIMEOUT (60)    // seconds a connection may make no progress
+
+enum { CONN_READ, CONN_WRITE };
+
+typedef struct {
+    char in[MAXBUF];               // request bytes as they arrive
+    char out[2 * MAXBUF];          // response header, or a whole error response
+} conn_buf_t;
+
+typedef struct conn {
+    int fd;
+    int state;
+    conn_buf_t *buf;
+    int in_len;                    // bytes in buf->in
+    http_request_t req;            // parsed so far, as slices of buf->in
+    int req_len;                   // header length of the request being answered
+    int keep_alive;                // serve another request after this one
+    int out_len, out_sent;
+    int file_fd;                   // body being sent, or -1
+    cache_entry_t *entry;          // or the cached body being sent, or NULL
+    off_t file_start, file_off, file_end; // the part of the file sent
+    int status;                    // of the response being sent
+    long start;                    // when its request was taken up
+    time_t last;                   // last progress, for the idle timeout
+    struct conn *prev, *next;      // activity list, least recent first
+} conn_t;
+
+typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    conn_t active;                 // head of the activity list
+} loop_t;
+
+//
+// The activity list keeps connections in the order they last made progress,
+// so that the idle sweep only ever looks at the ones that timed out
+//
+static void conn_unlink(conn_t *c) {
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+}
+
+static void conn_touch(loop_t *l, conn_t *c) {
+    c->last = time(NULL);
+    c->prev = l->active.prev;
+    c->next = &l->active;
+    l->active.prev->next = c;
+    l->active.prev = c;
+}
+
+//
+// The descriptor is taken out of the epoll set by hand: a CGI child may still
+// hold the socket, and epoll only forgets it once every copy is closed
+//
+static void conn_close(loop_t *l, conn_t *c) {
+    conn_unlink(c);
+    if (c->file_fd >= 0)
+	close_or_die(c->file_fd);
+    if (c->entry)
+	cache_put(c->entry);
+    assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) == 0);
+    close_or_die(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+//
+// Queues an error response; the connection is closed once it is sent
+//
+static void conn_error(conn_t *c, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    c->out_len = request_error_format(c->buf->out, sizeof(c->buf->out), cause, errnum, shortmsg, longmsg);
+    c->out_sent = 0;
+    c->status = atoi(errnum);
+    c->keep_alive = 0;
+    c->state = CONN_WRITE;
+}
+
+//
+// Answers the request whose header takes the first len bytes of the input
+// buffer, or -1 bytes if it could not be parsed. The header stays in the
+// buffer, and its slices good, until the response is sent. Returns -1 if
+// the connection was handed off and is gone.
+//
+static int conn_respond(loop_t *l, conn_t *c, int len) {
+    char filename[MAXBUF], cgiargs[MAXBUF], header[MAXBUF];
+    struct stat sbuf;
+    char *in = c->buf->in;
+    http_request_t *r = &c->req;
+
+    c->start = stats_now();
+    c->status = 200;
+    c->file_start = c->file_off = c->file_end = 0;
+    c->req_len = len;
+    if (len < 0) {
+	conn_error(c, "request header", "400", "Bad Request", "server could not parse this request");
+	return 0;
+    }
+
+    int http11 = http_equals(in, r->version, "HTTP/1.1");
+    c->keep_alive = http_keep_alive(in, r);
+    if (!http_equals(in, r->method, "GET")) {
+	char method[MAXBUF];
+	http_copy(in, r->method, method, MAXBUF);
+	conn_error(c, method, "501", "Not Implemented", "server does not implement this method");
+	return 0;
+    }
+
+    if (http_equals(in, r->path, "/__stats")) {
+	c->out_len = stats_response(c->buf->out, sizeof(c->buf->out), http11, c->keep_alive);
+	c->out_sent = 0;
+	c->state = CONN_WRITE;
+	return 0;
+    }
+
+    int is_static = request_parse_uri(in, r, filename, cgiargs);
+    if (stat(filename, &sbuf) < 0) {
+	conn_error(c, filename, "404", "Not found", "server could not find this file");
+	return 0;
+    }
+
+    if (!is_static) {
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+	    conn_error(c, filename, "403", "Forbidden", "server could not run this CGI program");
+	    return 0;
+	}
+	// the child's output goes straight to the client, after which the
+	// connection is closed
+	int n = request_spawn_dynamic(c->fd, filename, cgiargs);
+	stats_request(200, n, stats_now() - c->start);
+	conn_close(l, c);
+	return -1;
+    }
+
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+	conn_error(c, filename, "403", "Forbidden", "server could not read this file");
+	return 0;
+    }
+
+    int gzip = request_encoding(in, r, filename, &sbuf, &c->entry);
+    c->status = request_static(in, r, filename, &sbuf, c->entry, gzip, &c->file_off, &c->file_end, header, MAXBUF);
+    c->file_start = c->file_off;
+    if (c->entry && c->file_off == c->file_end) {
+	cache_put(c->entry);
+	c->entry = NULL;
+    }
+    if (!c->entry && c->file_off < c->file_end && (c->file_fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+	conn_error(c, filename, "403", "Forbidden", "server could not read this file");
+	return 0;
+    }
+    c->out_len = snprintf(c->buf->out, sizeof(c->buf->out), ""
+			  "%s %d %s\r\n"
+			  "Server: OSTEP WebServer\r\n"
+			  "%s"
+			  "Connection: %s\r\n\r\n",
+			  http11 ? "HTTP/1.1" : "HTTP/1.0", c->status, request_reason(c->status),
+			  header, c->keep_alive ? "keep-alive" : "close");
+    c->out_sent = 0;
+    c->state = CONN_WRITE;
+    return 0;
+}
+
+//
+// Sends as much of the response as the socket takes. Returns 1 when it is
+// all sent, 0 when the socket is full, -1 on error.
+//
+static int conn_send(conn_t *c) {
+    // a cached body goes out behind the header in the same writev()
+    while (c->entry && (c->out_sent < c->out_len || c->file_off < c->file_end)) {
+	struct iovec iov[] = {
+	    { c->buf->out + c->out_sent, c->out_len - c->out_sent },
+	    { c->entry->body + c->file_off, c->file_end - c->file_off },
+	};
+	ssize_t n = writev(c->fd, iov, 2);
+	if (n < 0)
+	    return errno == EAGAIN ? 0 : -1;
+	int header = n < iov[0].iov_len ? n : iov[0].iov_len;
+	c->out_sent += header;
+	c->file_off += n - header;
+    }
+    if (c->entry) {
+	cache_put(c->entry);
+	c->entry = NULL;
+	return 1;
+    }
+
+    // MSG_MORE holds a short header back until the body is queued behind it
+    int more = c->file_fd >= 0 && c->file_off < c->file_end ? MSG_MORE : 0;
+    while (c->out_sent < c->out_len) {
+	ssize_t n = send(c->fd, c->buf->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL | more);
+	if (n < 0)
+	    return errno == EAGAIN ? 0 : -1;
+	c->out_sent += n;
+    }
+    while (c->file_fd >= 0 && c->file_off < c->file_end) {
+	ssize_t n = sendfile(c->fd, c->file_fd, &c->file_off, c->file_end - c->file_off);
+	if (n < 0)
+	    return errno == EAGAIN ? 0 : -1;
+	if (n == 0)
+	    return -1;             // the file shrank under us
+    }
+    if (c->file_fd >= 0) {
+	close_or_die(c->file_fd);
+	c->file_fd = -1;
+    }
+    return 1;
+}
+
+//
+// Moves a connection along until it has to wait for the socket. Edge
+// triggering only reports new readiness, so every read and write here goes
+// on until it would block.
+//
+static void conn_run(loop_t *l, conn_t *c) {
+    conn_unlink(c);
+    conn_touch(l, c);
+    while (1) {
+	if (c->state == CONN_WRITE) {
+	    int rc = conn_send(c);
+	    if (rc == 0)
+		return;
+	    stats_request(c->status, c->out_sent + c->file_off - c->file_start, stats_now() - c->start);
+	    if (rc < 0 || !c->keep_alive) {
+		conn_close(l, c);
+		return;
+	    }
+	    // drop the request from the buffer: what follows is the next one
+	    c->in_len -= c->req_len;
+	    memmove(c->buf->in, c->buf->in + c->req_len, c->in_len);
+	    http_init(&c->req);
+	    c->state = CONN_READ;
+	}
+
+	int len = c->buf ? http_parse(&c->req, c->buf->in, c->in_len) : 0;
+	if (len != 0) {
+	    if (conn_respond(l, c, len) < 0)
+		return;
+	    continue;
+	}
+
+	if (!c->buf) {
+	    c->buf = malloc(sizeof(conn_buf_t));
+	    assert(c->buf != NULL);
+	}
+	if (c->in_len == MAXBUF) {
+	    c->start = stats_now();
+	    conn_error(c, "request header", "400", "Bad Request", "request header is too long");
+	    continue;
+	}
+	ssize_t n = read(c->fd, c->buf->in + c->in_len, MAXBUF - c->in_len);
+	if (n > 0) {
+	    c->in_len += n;
+	    continue;
+	}
+	if (n == 0 || errno != EAGAIN) {
+	    conn_close(l, c);
+	    return;
+	}
+	if (c->in_len == 0) {
+	    // nothing pending: an idle connection keeps no buffers
+	    free(c->buf);
+	    c->buf = NULL;
+	}
+	return;
+    }
+}
+
+static void loop_accept(loop_t *l) {
+    while (1) {
+	int fd = accept4(l->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+	    // out of descriptors: the rest are picked up by the next sweep
+	    assert(errno == EAGAIN || errno == EMFILE || errno == ENFILE ||
+		   errno == ECONNABORTED || errno == EINTR);
+	    if (errno == EAGAIN || errno == EMFILE || errno == ENFILE)
+		return;
+	    continue;
+	}
+	// MSG_MORE does the coalescing; Nagle would only hold back the
+	// responses to pipelined requests
+	int on = 1;
+	setsockopt_or_die(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	conn_t *c = calloc(1, sizeof(conn_t));
+	assert(c != NULL);
+	c->fd = fd;
+	c->file_fd = -1;
+	c->state = CONN_READ;
+	http_init(&c->req);
+	conn_touch(l, c);
+
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+	assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0);
+    }
+}
+
+static void loop_sweep(loop_t *l) {
+    time_t now = time(NULL);
+    while (l->active.next != &l->active && now - l->active.next->last >= EVENT_IDLE_TIMEOUT)
+	conn_close(l, l->active.next);
+}
+
+static void *loop_run(void *arg) {
+    int port = *(int *) arg;
+    struct epoll_event events[EVENT_BATCH];
+    loop_t l;
+
+    l.active.prev = l.active.next = &l.active;
+    l.listen_fd = open_shared_listen_fd_or_die(port);
+    assert(fcntl(l.listen_fd, F_SETFL, O_NONBLOCK) == 0);
+    l.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    assert(l.epoll_fd >= 0);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    assert(epoll_ctl(l.epoll_fd, EPOLL_CTL_ADD, l.listen_fd, &ev) == 0);
+
+    while (1) {
+	int n = epoll_wait(l.epoll_fd, events, EVENT_BATCH, 1000);
+	assert(n >= 0 || errno == EINTR);
+	for (int i = 0; i < n; i++) {
+	    if (events[i].data.ptr == NULL)
+		loop_accept(&l);
+	    else
+		conn_run(&l, events[i].data.ptr);
+	}
+	loop_sweep(&l);
+	if (n == 0)
+	    loop_accept(&l);
+    }
+    return NULL;
+}
+
+//
+// Runs 'loops' event loops on 'port', one in the calling thread; never
+// returns
+//
+void event_run(int port, int loops) {
+    static int event_port;
+    struct rlimit rl;
+
+    // one descriptor per connection: allow as many as we may
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);      // a vanished client is an error return, not a signal
+    signal(SIGCHLD, SIG_IGN);      // CGI children are never waited for
+
+    event_port = port;
+    for (int i = 1; i < loops; i++) {
+	pthread_t p;
+	pthread_create_or_die(&p, NULL, loop_run, &event_port);
+	pthread_detach(p);
+    }
+    loop_run(&event_port);
+}
@@ -0,0 +1,30 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+// Bucket math for the log-linear latency histograms kept by the server
+// (stats.c) and by wbench. With 'bits' sub-bucket bits, values below
+// 2^bits each get a bucket of their own, and every doubling above is split
+// into 2^bits buckets, so a bucket is within 1/2^bits of the values it
+// holds. There are 64 << bits buckets in all; the last also takes anything
+// larger.
+
+// The bucket that v falls in
+static inline int hist_index(long v, int bits) {
+    int sub = 1 << bits, buckets = 64 << bits;
+    if (v < sub)
+	return v < 0 ? 0 : v;
+    int e = 63 - __builtin_clzl(v);  // 2^e <= v < 2^(e+1)
+    int i = (e - bits + 1) * sub + (v >> (e - bits)) - sub;
+    return i < buckets ? i : buckets - 1;
+}
+
+// The largest value that falls in bucket i
+static inline long hist_upper(int i, int bits) {
+    int sub = 1 << bits;
+    if (i < 2 * sub)
+	return i;
+    int shift = i / sub - 1;
+    return ((long) (i % sub + sub + 1) << shift) - 1;
+}
+
+#endif // __HIST_H__
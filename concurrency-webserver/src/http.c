@@ -0,0 +1,197 @@
+#include "io_helper.h"
+#include "http.h"
+
+//
+// The parser goes a line at a time: memchr() finds its end, and only once it
+// is in are its parts picked out. Until then the next call picks up the
+// search where this one stopped.
+//
+enum {
+    S_START,                       // line endings ahead of the request line
+    S_LINE,                        // the request line
+    S_HEADER                       // a header line, or the blank line
+};
+
+static struct {
+    char *name;
+    int len;
+} headers[HTTP_HEADERS] = {
+    [HTTP_HOST] = { "Host", 4 },
+    [HTTP_CONNECTION] = { "Connection", 10 },
+    [HTTP_RANGE] = { "Range", 5 },
+    [HTTP_IF_MODIFIED_SINCE] = { "If-Modified-Since", 17 },
+    [HTTP_IF_NONE_MATCH] = { "If-None-Match", 13 },
+    [HTTP_ACCEPT_ENCODING] = { "Accept-Encoding", 15 },
+};
+
+void http_init(http_request_t *r) {
+    memset(r, 0, sizeof(http_request_t));
+}
+
+static http_slice_t http_slice(int from, int to) {
+    return (http_slice_t) { from, to - from };
+}
+
+// Where the first c in [from, to) is, or -1
+static int http_token(char *buf, int from, int to, char c) {
+    char *end = memchr(buf + from, c, to - from);
+    return end ? end - buf : -1;
+}
+
+//
+// The request line, from 'from' up to its line ending at 'to'
+//
+static int http_request_line(http_request_t *r, char *buf, int from, int to) {
+    int sp = http_token(buf, from, to, ' ');
+    if (sp <= from)
+	return -1;
+    for (int i = from; i < sp; i++)
+	if (!isalpha(buf[i]) && buf[i] != '-' && buf[i] != '_')
+	    return -1;
+    r->method = http_slice(from, sp);
+
+    from = sp + 1;
+    if ((sp = http_token(buf, from, to, ' ')) < 0 || buf[from] != '/')
+	return -1;
+    for (int i = from; i < sp; i++)
+	if (!isgraph(buf[i]))
+	    return -1;
+    int q = http_token(buf, from, sp, '?');
+    if (q < 0)
+	r->path = http_slice(from, sp);
+    else {
+	r->path = http_slice(from, q);
+	r->query = http_slice(q + 1, sp);
+    }
+
+    from = sp + 1;
+    if (to - from < 6 || strncmp(buf + from, "HTTP/", 5) || http_token(buf, from, to, ' ') >= 0)
+	return -1;
+    r->version = http_slice(from, to);
+    return 0;
+}
+
+//
+// A header line: only the headers in the table are kept, with the blanks
+// around their values left out
+//
+static int http_header_line(http_request_t *r, char *buf, int from, int to) {
+    int colon = http_token(buf, from, to, ':');
+    if (colon <= from)
+	return -1;
+    for (int h = 0; h < HTTP_HEADERS; h++) {
+	if (headers[h].len != colon - from || strncasecmp(headers[h].name, buf + from, colon - from))
+	    continue;
+	from = colon + 1;
+	while (from < to && (buf[from] == ' ' || buf[from] == '\t'))
+	    from++;
+	while (to > from && (buf[to - 1] == ' ' || buf[to - 1] == '\t'))
+	    to--;
+	r->headers[h] = http_slice(from, to);
+	break;
+    }
+    return 0;
+}
+
+//
+// Goes on from where the last call stopped, over the first len bytes of buf.
+// Returns the length of the request header once its blank line is in, 0 if
+// more bytes are needed, or -1 if the bytes are not a request header.
+//
+int http_parse(http_request_t *r, char *buf, int len) {
+    if (r->state == S_START) {
+	while (r->pos < len && (buf[r->pos] == '\r' || buf[r->pos] == '\n'))
+	    r->pos++;
+	if (r->pos == len)
+	    return 0;
+	r->mark = r->pos;
+	r->state = S_LINE;
+    }
+    while (r->pos < len) {
+	char *eol = memchr(buf + r->pos, '\n', len - r->pos);
+	if (eol == NULL) {
+	    r->pos = len;
+	    return 0;
+	}
+	int from = r->mark, to = eol - buf;
+	r->pos = r->mark = to + 1;
+	if (to > from && buf[to - 1] == '\r')
+	    to--;
+	if (r->state == S_LINE) {
+	    if (http_request_line(r, buf, from, to) < 0)
+		return -1;
+	    r->state = S_HEADER;
+	} else if (to == from)
+	    return r->pos;
+	else if (http_header_line(r, buf, from, to) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+// Whether the slice is str, ignoring case
+int http_equals(char *buf, http_slice_t s, char *str) {
+    return s.len == strlen(str) && !strncasecmp(buf + s.off, str, s.len);
+}
+
+// Whether token appears anywhere in the slice, ignoring case
+int http_has_token(char *buf, http_slice_t s, char *token) {
+    int n = strlen(token);
+    for (int i = 0; i + n <= s.len; i++)
+	if (!strncasecmp(buf + s.off + i, token, n))
+	    return 1;
+    return 0;
+}
+
+//
+// Whether a list such as Accept-Encoding's names token, or "*", with a
+// weight above zero; a token named outright wins over "*"
+//
+int http_accepts(char *buf, http_slice_t s, char *token) {
+    int n = strlen(token), end = s.off + s.len, star = 0;
+    for (int i = s.off; i < end; i++) {
+	while (i < end && (buf[i] == ' ' || buf[i] == '\t'))
+	    i++;
+	int from = i;
+	while (i < end && buf[i] != ',' && buf[i] != ';' && buf[i] != ' ' && buf[i] != '\t')
+	    i++;
+	int to = i, zero = 0;
+	for (; i < end && buf[i] != ','; i++)
+	    if ((buf[i] == 'q' || buf[i] == 'Q') && i + 1 < end && buf[i + 1] == '=') {
+		// all zeros, such as "0" or "0.000"
+		zero = 1;
+		for (i += 2; i < end && buf[i] != ',' && buf[i] != ' ' && buf[i] != ';'; i++)
+		    if (buf[i] != '0' && buf[i] != '.')
+			zero = 0;
+		i--;
+	    }
+	if (to - from == n && !strncasecmp(buf + from, token, n))
+	    return !zero;
+	if (to - from == 1 && buf[from] == '*')
+	    star = !zero;
+    }
+    return star;
+}
+
+//
+// HTTP/1.1 keeps the connection open unless asked not to, HTTP/1.0 only
+// when asked to
+//
+int http_keep_alive(char *buf, http_request_t *r) {
+    http_slice_t connection = r->headers[HTTP_CONNECTION];
+    if (http_has_token(buf, connection, "close"))
+	return 0;
+    return http_equals(buf, r->version, "HTTP/1.1") || http_has_token(buf, connection, "keep-alive");
+}
+
+//
+// For the few places that need a C string, such as a file name: copies as
+// much of the slice as fits into dst, with a '\0' behind it, and returns how
+// much that was
+//
+int http_copy(char *buf, http_slice_t s, char *dst, int size) {
+    int n = s.len < size - 1 ? s.len : size - 1;
+    memcpy(dst, buf + s.off, n);
+    dst[n] = '\0';
+    return n;
+}
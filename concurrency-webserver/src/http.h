@@ -0,0 +1,42 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+// A request header parser that works in place. It goes over the bytes once
+// and can stop wherever they run out, picking up from there when more have
+// arrived behind them. What it finds is kept as slices of the buffer: an
+// offset from its start and a length, so that they hold across a buffer
+// whose contents move as a whole. Nothing is copied and the buffer is not
+// written to.
+typedef struct {
+    int off;
+    int len;                       // 0: not there
+} http_slice_t;
+
+// the headers picked out of a request; the others are skipped
+enum {
+    HTTP_HOST,
+    HTTP_CONNECTION,
+    HTTP_RANGE,
+    HTTP_IF_MODIFIED_SINCE,
+    HTTP_IF_NONE_MATCH,
+    HTTP_ACCEPT_ENCODING,
+    HTTP_HEADERS
+};
+
+typedef struct {
+    int state;
+    int pos;                       // bytes looked at so far
+    int mark;                      // start of the line being read
+    http_slice_t method, path, query, version;
+    http_slice_t headers[HTTP_HEADERS];
+} http_request_t;
+
+void http_init(http_request_t *r);
+int http_parse(http_request_t *r, char *buf, int len);
+int http_equals(char *buf, http_slice_t s, char *str);
+int http_has_token(char *buf, http_slice_t s, char *token);
+int http_accepts(char *buf, http_slice_t s, char *token);
+int http_keep_alive(char *buf, http_request_t *r);
+int http_copy(char *buf, http_slice_t s, char *dst, int size);
+
+#endif // __HTTP_H__
@@ -1,27 +1,78 @@
 #include "io_helper.h"
 
-ssize_t readline(int fd, void *buf, size_t maxlen) {
-    char c;
+//
+// Buffered input, after Bryant/O'Halloran's rio package: readline() and
+// readn() take bytes out of the connection's buffer, and only call read()
+// once it runs dry
+//
+void rio_init(rio_t *rp, int fd) {
+    rp->fd = fd;
+    rp->cnt = 0;
+    rp->bufp = rp->buf;
+}
+
+//
+// Reads more in behind the bytes not taken yet, which first move to the
+// front of the buffer, so that a caller parsing in place sees them all in
+// one piece: returns bytes read, 0 on EOF (or a full buffer), -1 on error
+//
+ssize_t rio_fill(rio_t *rp) {
+    ssize_t rc;
+    memmove(rp->buf, rp->bufp, rp->cnt);
+    rp->bufp = rp->buf;
+    while ((rc = read(rp->fd, rp->buf + rp->cnt, sizeof(rp->buf) - rp->cnt)) < 0) {
+	if (errno != EINTR)
+	    return -1;
+    }
+    rp->cnt += rc;
+    return rc;
+}
+
+ssize_t readline(rio_t *rp, void *buf, size_t maxlen) {
     char *bufp = buf;
-    int n;
-    for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
-	int rc;
-        if ((rc = read_or_die(fd, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+    size_t n = 0;
+    while (n < maxlen - 1) { // leave room at end for '\0'
+	if (rp->cnt == 0) {
+	    ssize_t rc = rio_fill(rp);
+	    if (rc < 0)
+		return -1;    /* error */
+	    if (rc == 0)
+		break;        /* EOF */
+	}
+	size_t len = maxlen - 1 - n < rp->cnt ? maxlen - 1 - n : rp->cnt;
+	char *eol = memchr(rp->bufp, '\n', len);
+	if (eol)
+	    len = eol - rp->bufp + 1;
+	memcpy(bufp + n, rp->bufp, len);
+	rp->bufp += len;
+	rp->cnt -= len;
+	n += len;
+	if (eol)
+	    break;
     }
-    *bufp = '\0';
+    bufp[n] = '\0';
     return n;
 }
 
+ssize_t readn(rio_t *rp, void *buf, size_t count) {
+    char *bufp = buf;
+    size_t n = 0;
+    while (n < count) {
+	if (rp->cnt == 0) {
+	    ssize_t rc = rio_fill(rp);
+	    if (rc < 0)
+		return -1;    /* error */
+	    if (rc == 0)
+		break;        /* EOF */
+	}
+	size_t len = count - n < rp->cnt ? count - n : rp->cnt;
+	memcpy(bufp + n, rp->bufp, len);
+	rp->bufp += len;
+	rp->cnt -= len;
+	n += len;
+    }
+    return n;
+}
 
 int open_client_fd(char *hostname, int port) {
     int client_fd;
@@ -46,10 +97,14 @@ int open_client_fd(char *hostname, int port) {
     return client_fd;
 }
 
-int open_listen_fd(int port) {
+//
+// With 'shared' set, several sockets may listen on the same port at once
+// (SO_REUSEPORT), and the kernel spreads new connections across them
+//
+static int listen_fd_on(int port, int shared) {
     // Create a socket descriptor 
     int listen_fd;
-    if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
 	fprintf(stderr, "socket() failed\n");
 	return -1;
     }
@@ -60,6 +115,10 @@ int open_listen_fd(int port) {
 	fprintf(stderr, "setsockopt() failed\n");
 	return -1;
     }
+    if (shared && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+	fprintf(stderr, "setsockopt() failed\n");
+	return -1;
+    }
     
     // Listen_fd will be an endpoint for all requests to port on any IP address for this host
     struct sockaddr_in server_addr;
@@ -80,4 +139,12 @@ int open_listen_fd(int port) {
     return listen_fd;
 }
 
+int open_listen_fd(int port) {
+    return listen_fd_on(port, 0);
+}
+
+int open_shared_listen_fd(int port) {
+    return listen_fd_on(port, 1);
+}
+
 
@@ -8,6 +8,8 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,10 +17,12 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -34,6 +38,8 @@ typedef struct sockaddr sockaddr_t;
     assert(execve(filename, argv, envp) == 0); 
 #define wait_or_die(status) \
     ({ pid_t pid = wait(status); assert(pid >= 0); pid; })
+#define waitpid_or_die(pid, status, options) \
+    ({ pid_t rc = waitpid(pid, status, options); assert(rc >= 0); rc; })
 #define gethostname_or_die(name, len) \
     ({ int rc = gethostname(name, len); assert(rc == 0); rc; })
 #define setenv_or_die(name, value, overwrite) \
@@ -78,18 +84,48 @@ typedef struct sockaddr sockaddr_t;
     ({ struct hostent *p = gethostbyname(name); assert(p != NULL); p; })
 #define gethostbyaddr_or_die(addr, len, type) \
     ({ struct hostent *p = gethostbyaddr(addr, len, type); assert(p != NULL); p; })
+#define pthread_create_or_die(thread, attr, start_routine, arg) \
+    { assert(pthread_create(thread, attr, start_routine, arg) == 0); }
+#define pthread_mutex_lock_or_die(mutex) \
+    { assert(pthread_mutex_lock(mutex) == 0); }
+#define pthread_mutex_unlock_or_die(mutex) \
+    { assert(pthread_mutex_unlock(mutex) == 0); }
+#define pthread_cond_wait_or_die(cond, mutex) \
+    { assert(pthread_cond_wait(cond, mutex) == 0); }
+#define pthread_cond_signal_or_die(cond) \
+    { assert(pthread_cond_signal(cond) == 0); }
+#define pthread_cond_broadcast_or_die(cond) \
+    { assert(pthread_cond_broadcast(cond) == 0); }
+
+// buffered reading from a connection
+#define RIO_BUFSIZE (8192)
+typedef struct {
+    int fd;
+    size_t cnt;                // unread bytes in buf
+    char *bufp;                // next unread byte
+    char buf[RIO_BUFSIZE];
+} rio_t;
+
+void rio_init(rio_t *rp, int fd);
+ssize_t rio_fill(rio_t *rp);
+ssize_t readline(rio_t *rp, void *buf, size_t maxlen);
+ssize_t readn(rio_t *rp, void *buf, size_t count);
 
 // client/server helper functions 
-ssize_t readline(int fd, void *buf, size_t maxlen);
 int open_client_fd(char *hostname, int portno);
 int open_listen_fd(int portno);
+int open_shared_listen_fd(int portno);
 
 // wrappers for above
-#define readline_or_die(fd, buf, maxlen) \
-    ({ ssize_t rc = readline(fd, buf, maxlen); assert(rc >= 0); rc; })
+#define readline_or_die(rp, buf, maxlen) \
+    ({ ssize_t rc = readline(rp, buf, maxlen); assert(rc >= 0); rc; })
+#define readn_or_die(rp, buf, count) \
+    ({ ssize_t rc = readn(rp, buf, count); assert(rc >= 0); rc; })
 #define open_client_fd_or_die(hostname, port) \
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
 #define open_listen_fd_or_die(port) \
     ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define open_shared_listen_fd_or_die(port) \
+    ({ int rc = open_shared_listen_fd(port); assert(rc >= 0); rc; })
 
 #endif // __IO_HELPER__
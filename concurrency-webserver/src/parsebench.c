@@ -0,0 +1,180 @@
+//
+// parsebench.c: what reading one request header costs the server, in
+// read() calls and in time, with the buffered reader against reading a
+// byte per read() call as readline() used to, and the in-place parser
+// against both.
+//
+// To run:
+//      parsebench [requests]
+//
+// Each request is written into a socket pair and then read back: a line at
+// a time, the request line scanned with sscanf(), or (sliced) parsed where
+// it lies in the reader's buffer, as request_handle() does now. Then the
+// same parsing is timed on its own, on a request already in memory.
+//
+
+#define _GNU_SOURCE
+#include <time.h>
+#include "io_helper.h"
+#include "http.h"
+
+#define MAXBUF (8192)
+
+// A typical browser request, about 600 bytes
+static char request[] = ""
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:10000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "If-None-Match: \"5f1b2c3d-264\"\r\n"
+    "If-Modified-Since: Sat, 17 Oct 2026 00:00:00 GMT\r\n"
+    "\r\n";
+
+//
+// Linked with -Wl,--wrap=read, so that every read() call, including the
+// ones in io_helper.c, is counted here
+//
+static long reads = 0;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    reads++;
+    return __real_read(fd, buf, count);
+}
+
+//
+// The old readline(): one read() call per byte
+//
+static ssize_t readline_bytewise(int fd, void *buf, size_t maxlen) {
+    char c, *bufp = buf;
+    size_t n;
+    for (n = 0; n < maxlen - 1; n++) {
+	ssize_t rc = read_or_die(fd, &c, 1);
+	if (rc == 0)
+	    break;
+	*bufp++ = c;
+	if (c == '\n') {
+	    n++;
+	    break;
+	}
+    }
+    *bufp = '\0';
+    return n;
+}
+
+static void parse_bytewise(int fd) {
+    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
+
+    readline_bytewise(fd, buf, MAXBUF);
+    sscanf(buf, "%s %s %s", method, uri, version);
+    while (readline_bytewise(fd, buf, MAXBUF) > 0 && strcmp(buf, "\r\n"))
+	;
+}
+
+static void parse_buffered(int fd) {
+    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
+    rio_t rio;
+
+    rio_init(&rio, fd);
+    readline_or_die(&rio, buf, MAXBUF);
+    sscanf(buf, "%s %s %s", method, uri, version);
+    while (readline_or_die(&rio, buf, MAXBUF) > 0 && strcmp(buf, "\r\n"))
+	;
+}
+
+static void parse_sliced(int fd) {
+    http_request_t r;
+    rio_t rio;
+
+    rio_init(&rio, fd);
+    http_init(&r);
+    while (http_parse(&r, rio.bufp, rio.cnt) == 0)
+	assert(rio_fill(&rio) > 0);
+}
+
+//
+// In memory: the line scanning the server did before, copying each line out,
+// the request line's fields with sscanf(), and looking for Connection:
+//
+static void scan_lines(char *buf) {
+    char line[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
+    char *p = buf;
+    int close = 0;
+
+    for (int first = 1; ; first = 0) {
+	char *eol = strchr(p, '\n') + 1;
+	memcpy(line, p, eol - p);
+	line[eol - p] = '\0';
+	p = eol;
+	if (first)
+	    sscanf(line, "%s %s %s", method, uri, version);
+	else if (!strcmp(line, "\r\n"))
+	    break;
+	else if (!strncasecmp(line, "Connection:", 11))
+	    close = strcasestr(line, "close") != NULL;
+    }
+    assert(!close);
+}
+
+static void scan_sliced(char *buf) {
+    http_request_t r;
+
+    http_init(&r);
+    assert(http_parse(&r, buf, strlen(request)) > 0);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(char *name, void (*parse)(int), int fds[2], int requests) {
+    double elapsed = 0;
+
+    reads = 0;
+    for (int i = 0; i < requests; i++) {
+	write_or_die(fds[1], request, strlen(request));
+	double start = now_ns();
+	parse(fds[0]);
+	elapsed += now_ns() - start;
+    }
+    printf("%-9s %4zu bytes %8.1f read() calls %10.1f ns per request\n",
+	   name, strlen(request), (double) reads / requests, elapsed / requests);
+}
+
+static void run_memory(char *name, void (*parse)(char *), int requests) {
+    char buf[MAXBUF];
+
+    strcpy(buf, request);
+    double start = now_ns();
+    for (int i = 0; i < requests; i++)
+	parse(buf);
+    double elapsed = (now_ns() - start) / requests;
+    printf("%-9s %4zu bytes %10.1f ns per request %8.1f MB/s\n",
+	   name, strlen(request), elapsed, strlen(request) / elapsed * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+    int requests = argc > 1 ? atoi(argv[1]) : 100000;
+    int fds[2];
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    run("bytewise", parse_bytewise, fds, requests);
+    run("buffered", parse_buffered, fds, requests);
+    run("sliced", parse_sliced, fds, requests);
+    printf("in memory:\n");
+    run_memory("lines", scan_lines, requests);
+    run_memory("sliced", scan_sliced, requests);
+    exit(0);
+}
@@ -0,0 +1,217 @@
+#include "io_helper.h"
+#include "request.h"
+#include "pool.h"
+#include "stats.h"
+
+#define MAXBUF (8192)
+
+//
+// The connection buffer is a circular queue, guarded by one lock with the
+// two condition variables of the classic producer/consumer solution: the
+// master waits on 'empty' while every slot is taken, a worker waits on 'fill'
+// while there is nothing to serve.
+//
+// Under SFF and SRPT a worker takes the entry with the smallest size instead
+// of the oldest one, and moves the oldest into the hole it leaves.
+//
+// With a limit on how many connections may wait, or on how long the oldest
+// one has waited, the master turns a connection away with a 503 instead of
+// queuing it past the limit (and instead of waiting on 'empty'), so that
+// those let in are served within a bounded time and the rest find out at
+// once rather than when their client gives up.
+//
+
+typedef struct {
+    int fd;
+    off_t size;   // bytes the request asks for, the scheduling key
+    long queued;  // when it was handed to the pool (stats_now())
+} pool_entry_t;
+
+static pool_entry_t *buffer;
+static int max;
+static int fill_ptr = 0;
+static int use_ptr = 0;
+static int count = 0;
+static int policy = POOL_FIFO;
+static int max_queued = 0;         // 0: no limit
+static long max_wait = 0;          // in ns, 0: no limit
+static char shed_response[2 * MAXBUF];
+static int shed_len;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fill = PTHREAD_COND_INITIALIZER;
+
+// SRPT preemptions nest on the worker's stack; this bounds how deep
+#define POOL_MAX_PREEMPT (8)
+static __thread int preempt_depth = 0;
+
+//
+// Size of the file a request asks for, from a peek at its request line: the
+// data stays in the socket for the worker to read. A request whose line has
+// not fully arrived yet, or whose file cannot be found, counts as empty
+// rather than making the master wait or fail.
+//
+static off_t pool_request_size(int fd) {
+    char buf[MAXBUF], filename[MAXBUF], cgiargs[MAXBUF];
+    struct stat sbuf;
+    http_request_t r;
+    
+    // the socket blocks: without MSG_DONTWAIT one silent client would stop
+    // the master from accepting anyone else
+    ssize_t n = recv(fd, buf, MAXBUF, MSG_PEEK | MSG_DONTWAIT);
+    if (n <= 0)
+	return 0;
+    http_init(&r);
+    if (http_parse(&r, buf, n) < 0 || r.version.len == 0)
+	return 0;
+    request_parse_uri(buf, &r, filename, cgiargs);
+    if (stat(filename, &sbuf) < 0)
+	return 0;
+    return sbuf.st_size;
+}
+
+//
+// Whether a connection arriving now would go past a limit. Lock must be
+// held.
+//
+static int pool_over_limit(long now) {
+    if (count == max || (max_queued && count >= max_queued))
+	return 1;
+    // under SFF and SRPT the oldest is not always at use_ptr
+    for (int i = 0, j = use_ptr; max_wait && i < count; i++, j = (j + 1) % max)
+	if (now - buffer[j].queued > max_wait)
+	    return 1;
+    return 0;
+}
+
+//
+// Turns a connection away. The master must not block here: the response
+// only goes out if the socket takes it at once. The request is read off
+// first, as closing a socket with unread data resets the connection, and
+// the client might lose the response.
+//
+static void pool_shed(int fd, long start) {
+    char buf[MAXBUF];
+    
+    while (recv(fd, buf, MAXBUF, MSG_DONTWAIT) > 0)
+	;
+    ssize_t n = send(fd, shed_response, shed_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    close_or_die(fd);
+    stats_request(503, n > 0 ? n : 0, stats_now() - start);
+}
+
+//
+// Queue an accepted connection, blocking while the buffer is full, or
+// turning it away if it would go past a limit
+//
+void pool_put(int conn_fd) {
+    pool_entry_t entry = { conn_fd, 0, stats_now() };
+    if (policy != POOL_FIFO)
+	entry.size = pool_request_size(conn_fd);
+    
+    pthread_mutex_lock_or_die(&lock);
+    if ((max_queued || max_wait) && pool_over_limit(entry.queued)) {
+	pthread_mutex_unlock_or_die(&lock);
+	pool_shed(conn_fd, entry.queued);
+	return;
+    }
+    while (count == max)
+	pthread_cond_wait_or_die(&empty, &lock);
+    buffer[fill_ptr] = entry;
+    fill_ptr = (fill_ptr + 1) % max;
+    count++;
+    pthread_cond_signal_or_die(&fill);
+    pthread_mutex_unlock_or_die(&lock);
+}
+
+// Index of the entry to serve next. Lock must be held and count > 0.
+static int pool_pick() {
+    int pick = use_ptr;
+    if (policy != POOL_FIFO) {
+	int i, j;
+	for (i = 1, j = (use_ptr + 1) % max; i < count; i++, j = (j + 1) % max)
+	    if (buffer[j].size < buffer[pick].size)
+		pick = j;
+    }
+    return pick;
+}
+
+// Remove and return the entry at pick. Lock must be held.
+static pool_entry_t pool_take(int pick) {
+    pool_entry_t entry = buffer[pick];
+    buffer[pick] = buffer[use_ptr];
+    use_ptr = (use_ptr + 1) % max;
+    count--;
+    pthread_cond_signal_or_die(&empty);
+    return entry;
+}
+
+static pool_entry_t pool_get() {
+    pthread_mutex_lock_or_die(&lock);
+    while (count == 0)
+	pthread_cond_wait_or_die(&fill, &lock);
+    pool_entry_t entry = pool_take(pool_pick());
+    pthread_mutex_unlock_or_die(&lock);
+    return entry;
+}
+
+//
+// Called by a worker between chunks of a response with the bytes it has
+// left to send. Under SRPT, any queued request that is shorter than that is
+// served right here, to completion, before the current one resumes.
+//
+void pool_yield(off_t remaining) {
+    if (policy != POOL_SRPT || preempt_depth >= POOL_MAX_PREEMPT)
+	return;
+    while (1) {
+	pthread_mutex_lock_or_die(&lock);
+	int pick = count ? pool_pick() : -1;
+	if (pick < 0 || buffer[pick].size >= remaining) {
+	    pthread_mutex_unlock_or_die(&lock);
+	    return;
+	}
+	pool_entry_t entry = pool_take(pick);
+	pthread_mutex_unlock_or_die(&lock);
+	stats_wait(stats_now() - entry.queued);
+	
+	// the preempted response is waiting: no lingering for more requests
+	preempt_depth++;
+	request_handle(entry.fd, 0);
+	close_or_die(entry.fd);
+	preempt_depth--;
+    }
+}
+
+static void *pool_worker(void *arg) {
+    while (1) {
+	pool_entry_t entry = pool_get();
+	stats_wait(stats_now() - entry.queued);
+	request_handle(entry.fd, 1);
+	close_or_die(entry.fd);
+    }
+    return NULL;
+}
+
+//
+// queued and wait_ms limit how many connections may wait and for how long,
+// 0 for no limit
+//
+void pool_init(int threads, int buffers, int sched, int queued, int wait_ms) {
+    max = buffers;
+    policy = sched;
+    max_queued = queued;
+    max_wait = wait_ms * 1000000L;
+    shed_len = request_error_format(shed_response, sizeof(shed_response), "try again later", "503",
+				    "Service Unavailable", "server is overloaded");
+    buffer = malloc(max * sizeof(pool_entry_t));
+    assert(buffer != NULL);
+    
+    int i;
+    for (i = 0; i < threads; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, pool_worker, NULL);
+	pthread_detach(thread);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <sys/types.h>
+
+// A fixed pool of worker threads fed accepted connections through a bounded
+// buffer: the master thread produces, the workers consume. The policy decides
+// which buffered connection a worker takes next:
+//   FIFO  the oldest
+//   SFF   the one asking for the smallest file
+//   SRPT  like SFF, but a request still sending a large file is preempted
+//         by a queued one with fewer bytes to send (see pool_yield())
+// Past an optional limit on queued connections, or on how long they have
+// waited, a new connection gets a 503 from the master instead.
+enum { POOL_FIFO, POOL_SFF, POOL_SRPT };
+
+void pool_init(int threads, int buffers, int policy, int queued, int wait_ms);
+void pool_put(int conn_fd);
+void pool_yield(off_t remaining);
+
+#endif // __POOL_H__
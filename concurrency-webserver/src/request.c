@@ -1,5 +1,10 @@
+#define _GNU_SOURCE
 #include "io_helper.h"
 #include "request.h"
+#include "pool.h"
+#include "cache.h"
+#include "cgi.h"
+#include "stats.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
@@ -7,74 +12,69 @@
 //
 
 #define MAXBUF (8192)
+#define CHUNK (64 * 1024)
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
+// seconds a kept-alive connection may wait for its next request; a worker is
+// tied up for that long
+#define REQUEST_IDLE_TIMEOUT (5)
+
+//
+// Puts a whole error response, header and body, into buf and returns its
+// length
+//
+int request_error_format(char *buf, int size, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char body[MAXBUF];
     
     // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
-	    "<!doctype html>\r\n"
-	    "<head>\r\n"
-	    "  <title>OSTEP WebServer Error</title>\r\n"
-	    "</head>\r\n"
-	    "<body>\r\n"
-	    "  <h2>%s: %s</h2>\r\n" 
-	    "  <p>%s: %s</p>\r\n"
-	    "</body>\r\n"
-	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
-    
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
+    snprintf(body, MAXBUF, ""
+	     "<!doctype html>\r\n"
+	     "<head>\r\n"
+	     "  <title>OSTEP WebServer Error</title>\r\n"
+	     "</head>\r\n"
+	     "<body>\r\n"
+	     "  <h2>%s: %s</h2>\r\n" 
+	     "  <p>%s: %s</p>\r\n"
+	     "</body>\r\n"
+	     "</html>\r\n", errnum, shortmsg, longmsg, cause);
     
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
-    
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
+    int n = snprintf(buf, size, ""
+		     "HTTP/1.0 %s %s\r\n"
+		     "Content-Type: text/html\r\n"
+		     "Content-Length: %lu\r\n\r\n"
+		     "%s", errnum, shortmsg, strlen(body), body);
+    return n < size ? n : size - 1;
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Like the other senders below, returns -1 if the client has gone away:
+// that ends the connection, not the server
 //
-void request_read_headers(int fd) {
-    char buf[MAXBUF];
+int request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char buf[2 * MAXBUF];
     
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
-    }
-    return;
+    int n = request_error_format(buf, sizeof(buf), cause, errnum, shortmsg, longmsg);
+    return write(fd, buf, n);
 }
 
 //
 // Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
+// Calculates filename (and cgiargs, for dynamic) from the request's path
+// and query, which are slices of buf
 //
-int request_parse_uri(char *uri, char *filename, char *cgiargs) {
-    char *ptr;
+int request_parse_uri(char *buf, http_request_t *r, char *filename, char *cgiargs) {
+    // room for a '.' ahead and an "index.html" behind
+    filename[0] = '.';
+    int n = 1 + http_copy(buf, r->path, filename + 1, MAXBUF - 11);
     
-    if (!strstr(uri, "cgi")) { 
+    if (!strstr(filename, "cgi")) { 
 	// static
 	strcpy(cgiargs, "");
-	sprintf(filename, ".%s", uri);
-	if (uri[strlen(uri)-1] == '/') {
-	    strcat(filename, "index.html");
-	}
+	if (filename[n - 1] == '/')
+	    strcpy(filename + n, "index.html");
 	return 1;
     } else { 
 	// dynamic
-	ptr = index(uri, '?');
-	if (ptr) {
-	    strcpy(cgiargs, ptr+1);
-	    *ptr = '\0';
-	} else {
-	    strcpy(cgiargs, "");
-	}
-	sprintf(filename, ".%s", uri);
+	http_copy(buf, r->query, cgiargs, MAXBUF);
 	return 0;
     }
 }
@@ -93,88 +93,454 @@ void request_get_filetype(char *filename, char *filetype) {
 	strcpy(filetype, "text/plain");
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
-    char buf[MAXBUF], *argv[] = { NULL };
+//
+// The server's environment with QUERY_STRING set to cgiargs, for a CGI
+// child to exec with. query is MAXBUF bytes to hold that one variable; the
+// array is malloc'd, for the caller to free once the child has forked off.
+//
+static char **request_cgi_env(char *query, char *cgiargs) {
+    extern char **environ;
+    int n = 0, j = 1;
+    
+    while (environ[n])
+	n++;
+    char **envp = malloc((n + 2) * sizeof(char *));
+    assert(envp != NULL);
+    snprintf(query, MAXBUF, "QUERY_STRING=%s", cgiargs);
+    envp[0] = query;
+    for (int i = 0; i < n; i++)
+	if (strncmp(environ[i], "QUERY_STRING=", 13))
+	    envp[j++] = environ[i];
+    envp[j] = NULL;
+    return envp;
+}
+
+//
+// Returns the bytes the server itself sent: the CGI program's output is not
+// seen
+//
+int request_serve_dynamic(int fd, char *filename, char *cgiargs, char *status) {
+    char query[MAXBUF], *argv[] = { NULL };
+    
+    // a persistent worker of the program, if there is one, writes the rest
+    // after the status; if none takes the request, nothing has been sent
+    if (cgi_serve(fd, filename, cgiargs, status) == 0)
+	return strlen(status);
     
     // The server does only a little bit of the header.  
     // The CGI script has to finish writing out the header.
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n");
-    
-    write_or_die(fd, buf, strlen(buf));
+    if (write(fd, status, strlen(status)) < 0)
+	return -1;
     
-    if (fork_or_die() == 0) {                        // child
-	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
-	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
-	extern char **environ;                       // defined by libc 
-	execve_or_die(filename, argv, environ);
+    // the pool's other threads may hold the environment or malloc locks at
+    // the fork, so the child gets its environment ready-made
+    char **envp = request_cgi_env(query, cgiargs);
+    pid_t pid = fork_or_die();
+    if (pid == 0) {                                  // child
+	sigset_t none;                               // don't pass on the server's blocked signals
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	signal(SIGPIPE, SIG_DFL);                    // nor the server's ignored one
+	if (dup2(fd, STDOUT_FILENO) >= 0)            // make cgi writes go to socket (not screen)
+	    execve(filename, argv, envp);            // args to cgi go in QUERY_STRING
+	_exit(1);
     } else {
-	wait_or_die(NULL);
+	// other workers have CGI children of their own: reap only ours
+	waitpid_or_die(pid, NULL, 0);
     }
+    free(envp);
+    return strlen(status);
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
+//
+// For the event engines, which must not block in waitpid(): the child
+// writes the status line itself and runs the program, and is reaped by the
+// kernel (the engine ignores SIGCHLD). The child of a threaded process may
+// only make async-signal-safe calls until it execs, so its environment is
+// put together before the fork. Returns the bytes of header the child sends.
+//
+int request_spawn_dynamic(int fd, char *filename, char *cgiargs) {
+    char query[MAXBUF], *argv[] = { NULL };
+    char **envp = request_cgi_env(query, cgiargs);
+    
+    char *header = ""
+	"HTTP/1.0 200 OK\r\n"
+	"Server: OSTEP WebServer\r\n";
+    
+    if (fork_or_die() == 0) {
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	fcntl(fd, F_SETFL, 0);  // the CGI program expects a blocking stdout
+	if (write(fd, header, strlen(header)) == strlen(header) && dup2(fd, STDOUT_FILENO) >= 0)
+	    execve(filename, argv, envp);
+	_exit(1);
+    }
+    free(envp);
+    return strlen(header);
+}
+
+char *request_reason(int code) {
+    switch (code) {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 416: return "Range Not Satisfiable";
+    default: return "Unknown";
+    }
+}
+
+//
+// The validators of a file as sbuf describes it: an ETag from its inode,
+// size and mtime, and its mtime as an HTTP date
+//
+static void request_validators(struct stat *sbuf, char *etag, int size, char *date) {
+    struct tm tm;
+    snprintf(etag, size, "\"%lx-%llx-%llx\"", (unsigned long) sbuf->st_ino, (long long) sbuf->st_size,
+	     (long long) sbuf->st_mtim.tv_sec * 1000000000 + sbuf->st_mtim.tv_nsec);
+    gmtime_r(&sbuf->st_mtim.tv_sec, &tm);
+    strftime(date, 64, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+//
+// Whether the client's copy, as its If-None-Match or (only without one)
+// If-Modified-Since header describes it, is current
+//
+static int request_not_modified(char *buf, http_request_t *r, struct stat *sbuf, char *etag) {
+    http_slice_t match = r->headers[HTTP_IF_NONE_MATCH];
+    if (match.len > 0)
+	return http_equals(buf, match, "*") || http_has_token(buf, match, etag);
+    
+    char since[64];
+    struct tm tm;
+    if (r->headers[HTTP_IF_MODIFIED_SINCE].len == 0)
+	return 0;
+    http_copy(buf, r->headers[HTTP_IF_MODIFIED_SINCE], since, sizeof(since));
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return end != NULL && *end == '\0' && sbuf->st_mtim.tv_sec <= timegm(&tm);
+}
+
+//
+// Reads a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+// range into [*off, *end). Returns 1 if it is satisfiable, -1 if it is not,
+// 0 if there is none, or it is something else (several ranges, another
+// unit), in which case the whole file is sent.
+//
+static int request_range(char *buf, http_slice_t s, off_t size, off_t *off, off_t *end) {
+    char range[64], *p, *q;
+    long long first, last;
+    
+    if (s.len == 0 || s.len >= sizeof(range))
+	return 0;
+    http_copy(buf, s, range, sizeof(range));
+    if (strncmp(range, "bytes=", 6) || strchr(range, ','))
+	return 0;
+    p = range + 6;
+    if (*p == '-') {
+	last = strtoll(p + 1, &q, 10);
+	if (q == p + 1 || *q != '\0' || last < 0)
+	    return 0;
+	if (last == 0 || size == 0)
+	    return -1;
+	*off = last < size ? size - last : 0;
+	*end = size;
+	return 1;
+    }
+    first = strtoll(p, &q, 10);
+    if (q == p || *q != '-' || first < 0)
+	return 0;
+    p = q + 1;
+    last = size - 1;
+    if (*p != '\0') {
+	last = strtoll(p, &q, 10);
+	if (*q != '\0' || last < first)
+	    return 0;
+    }
+    if (first >= size)
+	return -1;
+    *off = first;
+    *end = last < size ? last + 1 : size;
+    return 1;
+}
+
+//
+// Picks what to send for a static file. When the client accepts gzip and
+// the file is text, that is a precompressed sibling (filename.gz, no older
+// than the file) if there is one, else the file compressed in the cache;
+// otherwise the file as it is. Changes filename and sbuf to the sibling's,
+// or sbuf's size to the compressed one, and sets *e to the cache entry to
+// send from, if any. Returns whether the body is gzip-encoded.
+//
+int request_encoding(char *buf, http_request_t *r, char *filename, struct stat *sbuf, cache_entry_t **e) {
+    char filetype[MAXBUF];
+    struct stat gz;
+    int n = strlen(filename);
     
     request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
+    if (strncmp(filetype, "text/", 5) || !http_accepts(buf, r->headers[HTTP_ACCEPT_ENCODING], "gzip")) {
+	*e = cache_get(filename, sbuf);
+	return 0;
+    }
     
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
+    if (n + 4 <= MAXBUF) {
+	strcpy(filename + n, ".gz");
+	if (stat(filename, &gz) == 0 && S_ISREG(gz.st_mode) && (S_IRUSR & gz.st_mode) &&
+	    gz.st_mtim.tv_sec >= sbuf->st_mtim.tv_sec) {
+	    *sbuf = gz;
+	    *e = cache_get(filename, sbuf);
+	    return 1;
+	}
+	filename[n] = '\0';
+    }
     
-    // put together response
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n"
-	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
+    if ((*e = cache_get_gzip(filename, sbuf)) && (*e)->body) {
+	sbuf->st_size = (*e)->size;
+	return 1;
+    }
+    if (*e)
+	cache_put(*e);
+    *e = cache_get(filename, sbuf);
+    return 0;
+}
+
+//
+// Decides, from the stat() already made, between the whole file (200), the
+// part of it the Range header asks for (206), nothing because the client's
+// copy is current (304), or nothing because the range is past the end
+// (416). Sets [*off, *end) to the bytes of the file to send, and puts the
+// header lines that go with them, up to but not including Connection, in
+// out. A cached entry, if there is one, lends its pre-rendered lines to a
+// 200. Ranges are of the body as sent, compressed if gzip is set. Returns
+// the status code.
+//
+int request_static(char *buf, http_request_t *r, char *filename, struct stat *sbuf, cache_entry_t *e, int gzip,
+		   off_t *off, off_t *end, char *out, int size) {
+    char etag[64], date[64], filetype[MAXBUF];
+    int code = 200, n;
     
-    write_or_die(fd, buf, strlen(buf));
+    request_get_filetype(filename, filetype);
+    request_validators(sbuf, etag, sizeof(etag), date);
+    n = snprintf(out, size, ""
+		 "ETag: %s\r\n"
+		 "Last-Modified: %s\r\n"
+		 "Accept-Ranges: bytes\r\n"
+		 "%s%s",
+		 etag, date, gzip ? "Content-Encoding: gzip\r\n" : "",
+		 strncmp(filetype, "text/", 5) ? "" : "Vary: Accept-Encoding\r\n");
+    *off = 0;
+    *end = sbuf->st_size;
+    if (request_not_modified(buf, r, sbuf, etag)) {
+	*end = 0;
+	return 304;
+    }
     
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    switch (request_range(buf, r->headers[HTTP_RANGE], sbuf->st_size, off, end)) {
+    case -1:
+	*off = *end = 0;
+	snprintf(out + n, size - n, ""
+		 "Content-Range: bytes */%lld\r\n"
+		 "Content-Length: 0\r\n",
+		 (long long) sbuf->st_size);
+	return 416;
+    case 1:
+	code = 206;
+	n += snprintf(out + n, size - n, "Content-Range: bytes %lld-%lld/%lld\r\n",
+		      (long long) *off, (long long) *end - 1, (long long) sbuf->st_size);
+	break;
+    }
+    
+    if (e && code == 200) {
+	snprintf(out + n, size - n, "%s", e->header);
+	return code;
+    }
+    snprintf(out + n, size - n, ""
+	     "Content-Length: %lld\r\n"
+	     "Content-Type: %s\r\n",
+	     (long long) (*end - *off), filetype);
+    return code;
+}
+
+//
+// Sends the status line in status, the header lines in header, and the
+// bytes [off, end) of the file. Returns the bytes sent, or -1.
+//
+off_t request_serve_static(int fd, char *filename, cache_entry_t *e, char *status, char *header, off_t off, off_t end) {
+    int srcfd, on = 1, uncork = 0;
+    
+    // put together response: only the part that varies is formatted, and
+    // writev() gathers it behind the fixed part; a cached body, or none at
+    // all, goes out with the header in a single writev()
+    struct iovec iov[] = {
+	{ status, strlen(status) },
+	{ header, strlen(header) },
+	{ "\r\n", 2 },
+	{ e ? e->body + off : NULL, e ? end - off : 0 },
+    };
+    if (e || off == end)
+	return writev(fd, iov, 4);
+    
+    srcfd = open_or_die(filename, O_RDONLY, 0);
+    
+    // Corked, the header and the start of the body leave in the same
+    // segments rather than the header going out on its own
+    setsockopt_or_die(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    ssize_t n = writev(fd, iov, 3);
+    
+    //  Rather than map the file and copy it out of user memory, sendfile()
+    //  moves the body from the page cache to the socket, a chunk at a time:
+    //  in between, a shorter request may preempt this one (SRPT)
+    off_t pos = off;
+    ssize_t rc = 1;
+    while (n >= 0 && pos < end) {
+	int chunk = end - pos < CHUNK ? end - pos : CHUNK;
+	if ((rc = sendfile(fd, srcfd, &pos, chunk)) <= 0)
+	    break;    // the client is gone, or the file shrank under us
+	pool_yield(end - pos);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &uncork, sizeof(uncork));
+    close_or_die(srcfd);
+    return n < 0 || rc < 0 ? -1 : n + pos - off;
 }
 
-// handle a request
-void request_handle(int fd) {
-    int is_static;
+//
+// Answers the request parsed into r, whose slices are of buf, and tells the
+// status code and bytes sent in *code and *bytes. Returns whether the
+// connection stays open for another one: only when may_keep allows it, the
+// client asked for it, and the response carried its own length.
+//
+static int request_respond(int fd, char *buf, http_request_t *r, int may_keep, int *code, off_t *bytes) {
+    int is_static, http11, keep_alive;
     struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
+    char filename[MAXBUF], cgiargs[MAXBUF], status[MAXBUF], header[MAXBUF];
+    off_t off, end;
     
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
+    if (!http_equals(buf, r->method, "GET")) {
+	char method[MAXBUF];
+	http_copy(buf, r->method, method, MAXBUF);
+	*bytes = request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
+	*code = 501;
+	return 0;
+    }
+    http11 = http_equals(buf, r->version, "HTTP/1.1");
+    keep_alive = may_keep && http_keep_alive(buf, r);
     
-    if (strcasecmp(method, "GET")) {
-	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
-	return;
+    if (http_equals(buf, r->path, "/__stats")) {
+	char response[2 * MAXBUF];
+	int n = stats_response(response, sizeof(response), http11, keep_alive);
+	*bytes = write(fd, response, n);
+	*code = 200;
+	return keep_alive;
     }
-    request_read_headers(fd);
     
-    is_static = request_parse_uri(uri, filename, cgiargs);
+    is_static = request_parse_uri(buf, r, filename, cgiargs);
     if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
-	return;
+	*bytes = request_error(fd, filename, "404", "Not found", "server could not find this file");
+	*code = 404;
+	return 0;
     }
     
     if (is_static) {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
-	    return;
+	    *bytes = request_error(fd, filename, "403", "Forbidden", "server could not read this file");
+	    *code = 403;
+	    return 0;
 	}
-	request_serve_static(fd, filename, sbuf.st_size);
     } else {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
-	    return;
+	    *bytes = request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
+	    *code = 403;
+	    return 0;
+	}
+	// the end of CGI output is only marked by closing the connection
+	keep_alive = 0;
+    }
+    
+    if (!is_static) {
+	sprintf(status, ""
+		"%s 200 OK\r\n"
+		"Server: OSTEP WebServer\r\n"
+		"Connection: close\r\n",
+		http11 ? "HTTP/1.1" : "HTTP/1.0");
+	*code = 200;
+	*bytes = request_serve_dynamic(fd, filename, cgiargs, status);
+	return 0;
+    }
+    
+    cache_entry_t *e;
+    int gzip = request_encoding(buf, r, filename, &sbuf, &e);
+    *code = request_static(buf, r, filename, &sbuf, e, gzip, &off, &end, header, MAXBUF);
+    sprintf(status, ""
+	    "%s %d %s\r\n"
+	    "Server: OSTEP WebServer\r\n"
+	    "Connection: %s\r\n",
+	    http11 ? "HTTP/1.1" : "HTTP/1.0", *code, request_reason(*code), keep_alive ? "keep-alive" : "close");
+    *bytes = request_serve_static(fd, filename, e, status, header, off, end);
+    if (e)
+	cache_put(e);
+    return keep_alive;
+}
+
+//
+// Serves the next request on the connection. Its header is parsed where it
+// lies in the reader's buffer, and the request is timed from when the
+// header is all in, so that the wait for a kept-alive client is not counted.
+//
+static int request_serve(rio_t *rp, int may_keep) {
+    http_request_t r;
+    int len, code = 0;
+    off_t bytes = 0;
+    
+    http_init(&r);
+    while ((len = http_parse(&r, rp->bufp, rp->cnt)) == 0) {
+	if (rp->cnt == RIO_BUFSIZE) {
+	    len = -1;
+	    break;
 	}
-	request_serve_dynamic(fd, filename, cgiargs);
+	// the client closed the connection, or kept it idle for too long
+	if (rio_fill(rp) <= 0)
+	    return 0;
+    }
+    long start = stats_now();
+    int keep_alive = 0;
+    if (len < 0) {
+	bytes = request_error(rp->fd, "request header", "400", "Bad Request", "server could not parse this request");
+	code = 400;
+    } else {
+	// the slices stay good until the next fill: what follows the header
+	// is the next request
+	char *buf = rp->bufp;
+	rp->bufp += len;
+	rp->cnt -= len;
+	keep_alive = request_respond(rp->fd, buf, &r, may_keep, &code, &bytes);
+    }
+    // a client that hung up mid-response gets no more
+    if (bytes < 0) {
+	bytes = 0;
+	keep_alive = 0;
+    }
+    stats_request(code, bytes, stats_now() - start);
+    return keep_alive;
+}
+
+//
+// Handle the requests on a connection, one after the other. Pipelined
+// requests wait in the reader's buffer and are picked up from there.
+//
+void request_handle(int fd, int keep_alive) {
+    rio_t rio;
+    
+    rio_init(&rio, fd);
+    if (keep_alive) {
+	// responses to pipelined requests must not wait on Nagle for the
+	// client to acknowledge the previous one
+	struct timeval idle = { REQUEST_IDLE_TIMEOUT, 0 };
+	int on = 1;
+	setsockopt_or_die(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+	setsockopt_or_die(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
     }
+    while (request_serve(&rio, keep_alive))
+	;
 }
@@ -1,5 +1,18 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void request_handle(int fd);
+#include <sys/stat.h>
+#include "http.h"
+#include "cache.h"
+
+void request_handle(int fd, int keep_alive);
+int request_parse_uri(char *buf, http_request_t *r, char *filename, char *cgiargs);
+void request_get_filetype(char *filename, char *filetype);
+char *request_reason(int code);
+int request_encoding(char *buf, http_request_t *r, char *filename, struct stat *sbuf, cache_entry_t **e);
+int request_static(char *buf, http_request_t *r, char *filename, struct stat *sbuf, cache_entry_t *e, int gzip,
+		   off_t *off, off_t *end, char *out, int size);
+int request_spawn_dynamic(int fd, char *filename, char *cgiargs);
+int request_error_format(char *buf, int size, char *cause, char *errnum, char *shortmsg, char *longmsg);
 
 #endif // __REQUEST_H__
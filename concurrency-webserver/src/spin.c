@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -21,18 +23,18 @@ double get_seconds() {
 }
 
 
-int main(int argc, char *argv[]) {
+void spin() {
     // Extract arguments
     double spin_for = 0.0;
     char *buf;
     if ((buf = getenv("QUERY_STRING")) != NULL) {
-	// just expecting a single number
-	spin_for = (double) atoi(buf);
+	// just expecting a single number, which may have a fraction
+	spin_for = atof(buf);
     }
 
-    double t1 = get_seconds();
-    while ((get_seconds() - t1) < spin_for)
-	sleep(1);
+    double t1 = get_seconds(), left;
+    while ((left = spin_for - (get_seconds() - t1)) > 0)
+	usleep(left < 1 ? left * 1e6 : 1000000);
     double t2 = get_seconds();
     
     /* Make the response body */
@@ -46,7 +48,52 @@ int main(int argc, char *argv[]) {
     printf("Content-Type: text/html\r\n\r\n");
     printf("%s", content);
     fflush(stdout);
+}
+
+//
+// As a persistent worker (CGI_PERSISTENT set, see cgi.h in the server),
+// requests come in on stdin: the query string, with the client's connection
+// attached. Returns that connection, or -1 when the server is gone.
+//
+int next_request(char *query, int size) {
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { query, size - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    int fd;
+    
+    ssize_t n = recvmsg(STDIN_FILENO, &msg, 0);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+	return -1;
+    query[n] = '\0';
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    char query[MAXBUF];
+    int fd;
     
+    if (getenv("CGI_PERSISTENT") == NULL) {
+	spin();
+	exit(0);
+    }
+    
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert(null_fd >= 0);
+    // tell the server we speak the protocol
+    if (write(STDIN_FILENO, "", 1) != 1)
+	exit(1);
+    while ((fd = next_request(query, MAXBUF)) >= 0) {
+	setenv("QUERY_STRING", query, 1);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+	spin();
+	// let go of the client's connection, then tell the server we are done
+	dup2(null_fd, STDOUT_FILENO);
+	if (write(STDIN_FILENO, "", 1) != 1)
+	    break;
+    }
     exit(0);
 }
 
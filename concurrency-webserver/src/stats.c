@@ -0,0 +1,233 @@
+#include <time.h>
+#include "io_helper.h"
+#include "stats.h"
+#include "hist.h"
+
+#define MAXBUF (8192)
+
+//
+// Times are bucketed in microseconds (hist.h): exact below 8 us, then 4
+// buckets per doubling, so a bucket is within 25% of the values it holds
+//
+#define STATS_SUB_BITS (2)
+#define STATS_BUCKETS (64 << STATS_SUB_BITS)
+#define STATS_CODES (600)
+
+typedef struct {
+    long count;
+    long sum;
+    long max;
+    long buckets[STATS_BUCKETS];   // log-linear, in microseconds
+} stats_hist_t;
+
+typedef struct {
+    long requests;
+    long bytes;
+    long status[STATS_CODES];
+    stats_hist_t wait;             // accept to the start of service
+    stats_hist_t service;          // request line to response sent
+} stats_t;
+
+//
+// A thread's slot is made on its first count and pushed onto a list that
+// only ever grows (the server's threads never exit). The owner updates its
+// counters with plain adds, stored atomically so that a reader never sees a
+// torn value; nothing is shared between writers, so nothing is locked.
+//
+
+typedef struct stats_slot {
+    stats_t s;
+    struct stats_slot *next;
+} stats_slot_t;
+
+static stats_slot_t *slots = NULL;
+static __thread stats_slot_t *mine = NULL;
+static long started;
+
+// only the owning thread writes a slot
+#define stats_add(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define stats_load(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+long stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void stats_init(void) {
+    started = stats_now();
+}
+
+static stats_t *stats_mine(void) {
+    if (mine == NULL) {
+	mine = calloc(1, sizeof(stats_slot_t));
+	assert(mine != NULL);
+	mine->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&slots, &mine->next, mine, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+    return &mine->s;
+}
+
+static void stats_hist_add(stats_hist_t *h, long ns) {
+    stats_add(h->count, 1);
+    stats_add(h->sum, ns);
+    stats_add(h->buckets[hist_index(ns / 1000, STATS_SUB_BITS)], 1);
+    if (ns > h->max)
+	__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+// Time a connection spent queued before a worker took it
+void stats_wait(long ns) {
+    stats_hist_add(&stats_mine()->wait, ns);
+}
+
+void stats_request(int status, off_t bytes, long ns) {
+    stats_t *s = stats_mine();
+    stats_add(s->requests, 1);
+    stats_add(s->bytes, bytes);
+    if (status > 0 && status < STATS_CODES)
+	stats_add(s->status[status], 1);
+    stats_hist_add(&s->service, ns);
+}
+
+static void stats_hist_sum(stats_hist_t *total, stats_hist_t *h) {
+    total->count += stats_load(h->count);
+    total->sum += stats_load(h->sum);
+    long max = stats_load(h->max);
+    if (max > total->max)
+	total->max = max;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+	total->buckets[i] += stats_load(h->buckets[i]);
+}
+
+//
+// Adds up every thread's counters into total. Returns the number of threads.
+//
+static int stats_total(stats_t *total) {
+    int threads = 0;
+
+    memset(total, 0, sizeof(stats_t));
+    for (stats_slot_t *p = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); p; p = p->next) {
+	stats_t *s = &p->s;
+	total->requests += stats_load(s->requests);
+	total->bytes += stats_load(s->bytes);
+	for (int i = 0; i < STATS_CODES; i++)
+	    total->status[i] += stats_load(s->status[i]);
+	stats_hist_sum(&total->wait, &s->wait);
+	stats_hist_sum(&total->service, &s->service);
+	threads++;
+    }
+    return threads;
+}
+
+// Upper bound of the p-th percentile, in milliseconds
+static double stats_percentile(stats_hist_t *h, double p) {
+    long target = (long) (h->count * p / 100 + 0.999), seen = 0;
+    int i;
+
+    if (h->count == 0)
+	return 0;
+    for (i = 0; i < STATS_BUCKETS - 1; i++)
+	if ((seen += h->buckets[i]) >= target)
+	    break;
+    // the bucket's bound may lie past the largest time seen
+    long upper = hist_upper(i, STATS_SUB_BITS);
+    return upper * 1000 < h->max ? upper / 1000.0 : h->max / 1e6;
+}
+
+static int stats_hist_format(char *buf, int size, char *name, stats_hist_t *h) {
+    return snprintf(buf, size, ""
+		    "%s_count %ld\n"
+		    "%s_mean_ms %.3f\n"
+		    "%s_p50_ms %.3f\n"
+		    "%s_p90_ms %.3f\n"
+		    "%s_p99_ms %.3f\n"
+		    "%s_max_ms %.3f\n",
+		    name, h->count,
+		    name, h->count ? h->sum / 1e6 / h->count : 0,
+		    name, stats_percentile(h, 50),
+		    name, stats_percentile(h, 90),
+		    name, stats_percentile(h, 99),
+		    name, h->max / 1e6);
+}
+
+//
+// Puts the /__stats response, header and body, into buf and returns its
+// length. The body has one "name value" pair per line, counted since the
+// server started.
+//
+int stats_response(char *buf, int size, int http11, int keep_alive) {
+    char body[MAXBUF];
+    stats_t total;
+    int n = 0;
+
+    int threads = stats_total(&total);
+    n += snprintf(body + n, MAXBUF - n, ""
+		  "uptime_seconds %.3f\n"
+		  "threads %d\n"
+		  "requests %ld\n"
+		  "bytes %ld\n",
+		  (stats_now() - started) / 1e9, threads, total.requests, total.bytes);
+    for (int i = 0; i < STATS_CODES && n < MAXBUF; i++)
+	if (total.status[i])
+	    n += snprintf(body + n, MAXBUF - n, "status_%d %ld\n", i, total.status[i]);
+    if (n < MAXBUF)
+	n += stats_hist_format(body + n, MAXBUF - n, "wait", &total.wait);
+    if (n < MAXBUF)
+	n += stats_hist_format(body + n, MAXBUF - n, "service", &total.service);
+    if (n >= MAXBUF)
+	n = MAXBUF - 1;
+
+    n = snprintf(buf, size, ""
+		 "%s 200 OK\r\n"
+		 "Server: OSTEP WebServer\r\n"
+		 "Content-Length: %d\r\n"
+		 "Content-Type: text/plain\r\n"
+		 "Connection: %s\r\n\r\n"
+		 "%s",
+		 http11 ? "HTTP/1.1" : "HTTP/1.0", n, keep_alive ? "keep-alive" : "close", body);
+    return n < size ? n : size - 1;
+}
+
+static void stats_hist_delta(stats_hist_t *h, stats_hist_t *prev) {
+    h->count -= prev->count;
+    h->sum -= prev->sum;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+	h->buckets[i] -= prev->buckets[i];
+}
+
+//
+// Prints one line about the requests since the last call. Only the thread
+// that reports may call it.
+//
+void stats_report(FILE *out) {
+    static stats_t prev;
+    static long prev_time = 0;
+    stats_t now;
+    long classes[6] = { 0 };
+
+    stats_total(&now);
+    long t = stats_now();
+    double seconds = (t - (prev_time ? prev_time : started)) / 1e9;
+    stats_t delta = now;
+    delta.requests -= prev.requests;
+    delta.bytes -= prev.bytes;
+    for (int i = 0; i < STATS_CODES; i++)
+	classes[i / 100] += now.status[i] - prev.status[i];
+    stats_hist_delta(&delta.wait, &prev.wait);
+    stats_hist_delta(&delta.service, &prev.service);
+    prev = now;
+    prev_time = t;
+
+    fprintf(out, "stats: %ld requests in %.1f s (%.1f/s, %.2f MiB/s)", delta.requests, seconds,
+	    delta.requests / seconds, delta.bytes / seconds / 1048576);
+    if (delta.requests)
+	fprintf(out, ", 2xx %ld 3xx %ld 4xx %ld 5xx %ld, service p50 %.3f p99 %.3f ms",
+		classes[2], classes[3], classes[4], classes[5],
+		stats_percentile(&delta.service, 50), stats_percentile(&delta.service, 99));
+    if (delta.wait.count)
+	fprintf(out, ", wait p50 %.3f p99 %.3f ms",
+		stats_percentile(&delta.wait, 50), stats_percentile(&delta.wait, 99));
+    fprintf(out, "\n");
+}
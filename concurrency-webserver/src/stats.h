@@ -0,0 +1,21 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Server counters: requests, bytes sent, responses by status code, and
+// histograms of how long connections waited in the pool's queue and how long
+// requests took to serve. Every thread that serves requests counts into a
+// slot of its own that only it writes, so counting takes no lock; readers add
+// the slots up as they go, and a total may be a request or so behind.
+//
+// Times are in nanoseconds of the monotonic clock (stats_now()).
+void stats_init(void);
+long stats_now(void);
+void stats_wait(long ns);
+void stats_request(int status, off_t bytes, long ns);
+int stats_response(char *buf, int size, int http11, int keep_alive);
+void stats_report(FILE *out);
+
+#endif // __STATS_H__
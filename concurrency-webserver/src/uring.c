@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include "io_helper.h"
+#include "request.h"
+#include "uring.h"
+#include "cache.h"
+#include "stats.h"
+
+#define MAXBUF (8192)
+#define CHUNK (64 * 1024)          // the default pipe capacity
+
+//
+// The io_uring engine. As in the epoll engine, each loop thread owns a
+// listening socket on the shared port and serves its connections alone; but
+// rather than wait until a socket is ready and then make the call itself, a
+// loop queues the calls (accept, recv, statx, openat, send, splice) on the
+// submission ring and takes their results off the completion ring. Whatever
+// one round of completions queues up reaches the kernel in a single
+// io_uring_enter(), which also waits for the next round.
+//
+// A connection has one call in flight at a time, plus the timeout linked to
+// a socket call, so its state tells what a completion is the result of.
+// Between requests it keeps only its conn_t, whose input buffer the pending
+// recv fills.
+// splice() needs a pipe at one end: a file body goes to the socket through a
+// pipe of the connection's own, a chunk at a time.
+//
+// The ring is set up and driven with the bare system calls and the kernel's
+// header; there is no liburing to rely on.
+//
+
+#define URING_ENTRIES (4096)
+#define URING_IDLE_TIMEOUT (60)    // seconds a socket call may take
+
+// what a completion is the result of; kept in the low bits of user_data
+enum { OP_NONE, OP_ACCEPT, OP_RECV, OP_STATX, OP_OPEN, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT };
+#define OP_MASK (7)
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned tail;                 // ours: sqes filled in, not all submitted
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} ring_t;
+
+typedef struct {
+    ring_t ring;
+    int listen_fd;
+} uloop_t;
+
+typedef struct {
+    struct statx stx;
+    char filename[MAXBUF], cgiargs[MAXBUF];
+    char out[2 * MAXBUF];          // response header, or a whole error response
+} uconn_buf_t;
+
+typedef struct {
+    int fd;
+    int in_len;                    // bytes in 'in'
+    http_request_t req;            // parsed so far, as slices of 'in'
+    int req_len;                   // header length of the request being answered
+    int is_static, http11;         // of the request being answered
+    int keep_alive;                // serve another request after this one
+    int out_len, out_sent;
+    int file_fd;                   // body being sent, or -1
+    cache_entry_t *entry;          // or the cached body being sent, or NULL
+    off_t file_start, file_off, file_end; // the part of the file sent
+    int pipe_fd[2];                // made on the first file sent
+    int piped;                     // bytes of the body in the pipe
+    int status;                    // of the response being sent
+    long start;                    // when its request was taken up
+    struct iovec iov[2];           // for a cached body
+    struct msghdr msg;
+    uconn_buf_t *buf;              // while a request is being answered
+    char in[MAXBUF];               // request bytes as they arrive
+} uconn_t;
+
+static void ring_init(ring_t *r) {
+    struct io_uring_params p;
+
+    // one thread submits, and the kernel's part of a completion may wait
+    // until that thread enters the ring again; older kernels lack both
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (r->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+	fprintf(stderr, "io_uring is not available: %s\n", r->fd < 0 ? strerror(errno) : "kernel too old");
+	exit(1);
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = mmap_or_die(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap_or_die(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    r->sq_head = (unsigned *) (rings + p.sq_off.head);
+    r->sq_tail = (unsigned *) (rings + p.sq_off.tail);
+    r->sq_array = (unsigned *) (rings + p.sq_off.array);
+    r->sq_mask = *(unsigned *) (rings + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->tail = *r->sq_tail;
+    r->cq_head = (unsigned *) (rings + p.cq_off.head);
+    r->cq_tail = (unsigned *) (rings + p.cq_off.tail);
+    r->cq_mask = *(unsigned *) (rings + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+
+    // sqe i always sits in slot i
+    for (unsigned i = 0; i < p.sq_entries; i++)
+	r->sq_array[i] = i;
+}
+
+//
+// Submits what was queued and, with 'wait', waits for at least that many
+// completions
+//
+static void ring_enter(ring_t *r, int wait) {
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    unsigned submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    int rc = syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    assert(rc >= 0 || errno == EINTR || errno == EBUSY || errno == EAGAIN);
+}
+
+// Submits until n sqes are free
+static void ring_room(ring_t *r, unsigned n) {
+    while (r->tail + n - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_entries)
+	ring_enter(r, 0);
+}
+
+// The next free sqe, zeroed
+static struct io_uring_sqe *ring_sqe(ring_t *r) {
+    ring_room(r, 1);
+    struct io_uring_sqe *sqe = &r->sqes[r->tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//
+// Queues a call on the connection's socket, with a timeout linked to it: a
+// client that stops reading or sending has the call cancelled
+//
+static struct io_uring_sqe *ring_socket_sqe(ring_t *r, uconn_t *c, int op, int opcode) {
+    static struct __kernel_timespec idle = { URING_IDLE_TIMEOUT, 0 };
+    // the two go in together, or the link would dangle
+    ring_room(r, 2);
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    sqe->opcode = opcode;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uintptr_t) c | op;
+
+    struct io_uring_sqe *t = ring_sqe(r);
+    t->opcode = IORING_OP_LINK_TIMEOUT;
+    t->addr = (uintptr_t) &idle;
+    t->len = 1;
+    t->user_data = OP_NONE;
+    return sqe;
+}
+
+static void uloop_accept(uloop_t *l) {
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void uconn_close(uconn_t *c) {
+    if (c->file_fd >= 0)
+	close_or_die(c->file_fd);
+    if (c->entry)
+	cache_put(c->entry);
+    if (c->pipe_fd[0] >= 0) {
+	close_or_die(c->pipe_fd[0]);
+	close_or_die(c->pipe_fd[1]);
+    }
+    close_or_die(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static void uconn_recv(uloop_t *l, uconn_t *c) {
+    struct io_uring_sqe *sqe = ring_socket_sqe(&l->ring, c, OP_RECV, IORING_OP_RECV);
+    sqe->addr = (uintptr_t) (c->in + c->in_len);
+    sqe->len = MAXBUF - c->in_len;
+}
+
+static void uconn_next(uloop_t *l, uconn_t *c);
+
+//
+// Queues the next step of the response: the rest of the header (and of a
+// cached body), then the file through the pipe. Once it is all sent, goes
+// on to the next request.
+//
+static void uconn_send(uloop_t *l, uconn_t *c) {
+    ring_t *r = &l->ring;
+    struct io_uring_sqe *sqe;
+    int more = c->file_fd >= 0 && c->file_off < c->file_end;
+
+    if (c->entry && (c->out_sent < c->out_len || c->file_off < c->file_end)) {
+	c->iov[0] = (struct iovec) { c->buf->out + c->out_sent, c->out_len - c->out_sent };
+	c->iov[1] = (struct iovec) { c->entry->body + c->file_off, c->file_end - c->file_off };
+	c->msg = (struct msghdr) { .msg_iov = c->iov, .msg_iovlen = 2 };
+	sqe = ring_socket_sqe(r, c, OP_SEND, IORING_OP_SENDMSG);
+	sqe->addr = (uintptr_t) &c->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	return;
+    }
+    if (c->out_sent < c->out_len) {
+	// MSG_MORE holds a short header back until the body is queued behind it
+	sqe = ring_socket_sqe(r, c, OP_SEND, IORING_OP_SEND);
+	sqe->addr = (uintptr_t) (c->buf->out + c->out_sent);
+	sqe->len = c->out_len - c->out_sent;
+	sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+	return;
+    }
+    if (c->piped > 0) {
+	sqe = ring_socket_sqe(r, c, OP_SPLICE_OUT, IORING_OP_SPLICE);
+	sqe->splice_fd_in = c->pipe_fd[0];
+	sqe->splice_off_in = -1;
+	sqe->off = -1;
+	sqe->len = c->piped;
+	sqe->splice_flags = more ? SPLICE_F_MORE : 0;
+	return;
+    }
+    if (more) {
+	sqe = ring_sqe(r);
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->fd = c->pipe_fd[1];
+	sqe->splice_fd_in = c->file_fd;
+	sqe->splice_off_in = c->file_off;
+	sqe->off = -1;
+	sqe->len = c->file_end - c->file_off < CHUNK ? c->file_end - c->file_off : CHUNK;
+	sqe->user_data = (uintptr_t) c | OP_SPLICE_IN;
+	return;
+    }
+
+    stats_request(c->status, c->out_sent + c->file_off - c->file_start, stats_now() - c->start);
+    if (c->file_fd >= 0) {
+	close_or_die(c->file_fd);
+	c->file_fd = -1;
+    }
+    if (c->entry) {
+	cache_put(c->entry);
+	c->entry = NULL;
+    }
+    free(c->buf);
+    c->buf = NULL;
+    if (!c->keep_alive) {
+	uconn_close(c);
+	return;
+    }
+    // drop the request from the buffer: what follows is the next one
+    c->in_len -= c->req_len;
+    memmove(c->in, c->in + c->req_len, c->in_len);
+    http_init(&c->req);
+    uconn_next(l, c);
+}
+
+//
+// Queues an error response; the connection is closed once it is sent
+//
+static void uconn_error(uloop_t *l, uconn_t *c, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    if (c->buf == NULL) {
+	c->buf = malloc(sizeof(uconn_buf_t));
+	assert(c->buf != NULL);
+    }
+    c->out_len = request_error_format(c->buf->out, sizeof(c->buf->out), cause, errnum, shortmsg, longmsg);
+    c->out_sent = 0;
+    c->status = atoi(errnum);
+    c->keep_alive = 0;
+    uconn_send(l, c);
+}
+
+//
+// Answers the request whose header takes the first len bytes of the buffer,
+// or -1 bytes if it could not be parsed: whatever is needed about the file
+// is asked of the ring. The header stays in the buffer, and its slices good,
+// until the response is sent.
+//
+static void uconn_request(uloop_t *l, uconn_t *c, int len) {
+    http_request_t *r = &c->req;
+
+    c->buf = malloc(sizeof(uconn_buf_t));
+    assert(c->buf != NULL);
+    c->start = stats_now();
+    c->status = 200;
+    c->out_sent = 0;
+    c->file_start = c->file_off = c->file_end = 0;
+    c->req_len = len;
+
+    if (len < 0) {
+	uconn_error(l, c, "request header", "400", "Bad Request", "server could not parse this request");
+	return;
+    }
+    int http11 = http_equals(c->in, r->version, "HTTP/1.1");
+    c->keep_alive = http_keep_alive(c->in, r);
+    if (!http_equals(c->in, r->method, "GET")) {
+	char method[MAXBUF];
+	http_copy(c->in, r->method, method, MAXBUF);
+	uconn_error(l, c, method, "501", "Not Implemented", "server does not implement this method");
+	return;
+    }
+    if (http_equals(c->in, r->path, "/__stats")) {
+	c->out_len = stats_response(c->buf->out, sizeof(c->buf->out), http11, c->keep_alive);
+	uconn_send(l, c);
+	return;
+    }
+
+    c->is_static = request_parse_uri(c->in, r, c->buf->filename, c->buf->cgiargs);
+    c->http11 = http11;
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) c->buf->filename;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uintptr_t) &c->buf->stx;
+    sqe->user_data = (uintptr_t) c | OP_STATX;
+}
+
+static void uconn_statted(uloop_t *l, uconn_t *c, int res) {
+    struct stat sbuf;
+
+    if (res < 0) {
+	uconn_error(l, c, c->buf->filename, "404", "Not found", "server could not find this file");
+	return;
+    }
+    memset(&sbuf, 0, sizeof(sbuf));
+    sbuf.st_dev = makedev(c->buf->stx.stx_dev_major, c->buf->stx.stx_dev_minor);
+    sbuf.st_ino = c->buf->stx.stx_ino;
+    sbuf.st_mode = c->buf->stx.stx_mode;
+    sbuf.st_size = c->buf->stx.stx_size;
+    sbuf.st_mtim.tv_sec = c->buf->stx.stx_mtime.tv_sec;
+    sbuf.st_mtim.tv_nsec = c->buf->stx.stx_mtime.tv_nsec;
+
+    if (!c->is_static) {
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+	    uconn_error(l, c, c->buf->filename, "403", "Forbidden", "server could not run this CGI program");
+	    return;
+	}
+	// the child's output goes straight to the client, after which the
+	// connection is closed
+	int n = request_spawn_dynamic(c->fd, c->buf->filename, c->buf->cgiargs);
+	stats_request(200, n, stats_now() - c->start);
+	uconn_close(c);
+	return;
+    }
+
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+	uconn_error(l, c, c->buf->filename, "403", "Forbidden", "server could not read this file");
+	return;
+    }
+    char header[MAXBUF];
+    int gzip = request_encoding(c->in, &c->req, c->buf->filename, &sbuf, &c->entry);
+    c->status = request_static(c->in, &c->req, c->buf->filename, &sbuf, c->entry, gzip,
+			       &c->file_off, &c->file_end, header, MAXBUF);
+    c->file_start = c->file_off;
+    if (c->entry && c->file_off == c->file_end) {
+	cache_put(c->entry);
+	c->entry = NULL;
+    }
+    c->out_len = snprintf(c->buf->out, sizeof(c->buf->out), ""
+			  "%s %d %s\r\n"
+			  "Server: OSTEP WebServer\r\n"
+			  "%s"
+			  "Connection: %s\r\n\r\n",
+			  c->http11 ? "HTTP/1.1" : "HTTP/1.0", c->status, request_reason(c->status),
+			  header, c->keep_alive ? "keep-alive" : "close");
+    if (c->entry || c->file_off == c->file_end) {
+	uconn_send(l, c);
+	return;
+    }
+
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) c->buf->filename;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = (uintptr_t) c | OP_OPEN;
+}
+
+static void uconn_opened(uloop_t *l, uconn_t *c, int res) {
+    if (res < 0) {
+	uconn_error(l, c, c->buf->filename, "403", "Forbidden", "server could not read this file");
+	return;
+    }
+    c->file_fd = res;
+    if (c->pipe_fd[0] < 0)
+	assert(pipe2(c->pipe_fd, O_CLOEXEC) == 0);
+    uconn_send(l, c);
+}
+
+//
+// Answers the next request if its header is in, or reads more of it
+//
+static void uconn_next(uloop_t *l, uconn_t *c) {
+    int len = http_parse(&c->req, c->in, c->in_len);
+    if (len != 0)
+	uconn_request(l, c, len);
+    else if (c->in_len == MAXBUF) {
+	c->start = stats_now();
+	uconn_error(l, c, "request header", "400", "Bad Request", "request header is too long");
+    } else
+	uconn_recv(l, c);
+}
+
+static void uconn_complete(uloop_t *l, uconn_t *c, int op, int res) {
+    switch (op) {
+    case OP_RECV:
+	if (res <= 0) {
+	    uconn_close(c);
+	    return;
+	}
+	c->in_len += res;
+	uconn_next(l, c);
+	return;
+    case OP_STATX:
+	uconn_statted(l, c, res);
+	return;
+    case OP_OPEN:
+	uconn_opened(l, c, res);
+	return;
+    case OP_SEND:
+	if (res < 0) {
+	    uconn_close(c);
+	    return;
+	}
+	int header = res < c->out_len - c->out_sent ? res : c->out_len - c->out_sent;
+	c->out_sent += header;
+	c->file_off += res - header;
+	uconn_send(l, c);
+	return;
+    case OP_SPLICE_IN:
+	// nothing read: the file shrank under us
+	if (res <= 0) {
+	    uconn_close(c);
+	    return;
+	}
+	c->file_off += res;
+	c->piped += res;
+	uconn_send(l, c);
+	return;
+    case OP_SPLICE_OUT:
+	if (res <= 0) {
+	    uconn_close(c);
+	    return;
+	}
+	c->piped -= res;
+	uconn_send(l, c);
+	return;
+    }
+}
+
+static void uloop_accepted(uloop_t *l, int res, unsigned flags) {
+    // a multishot accept stays armed until it reports otherwise
+    if (!(flags & IORING_CQE_F_MORE))
+	uloop_accept(l);
+    if (res < 0)
+	return;
+
+    // MSG_MORE does the coalescing; Nagle would only hold back the
+    // responses to pipelined requests
+    int on = 1;
+    setsockopt_or_die(res, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    uconn_t *c = malloc(sizeof(uconn_t));
+    assert(c != NULL);
+    memset(c, 0, offsetof(uconn_t, in));
+    c->fd = res;
+    c->file_fd = -1;
+    c->pipe_fd[0] = c->pipe_fd[1] = -1;
+    http_init(&c->req);
+    uconn_recv(l, c);
+}
+
+static void *uloop_run(void *arg) {
+    int port = *(int *) arg;
+    uloop_t l;
+    ring_t *r = &l.ring;
+
+    ring_init(r);
+    l.listen_fd = open_shared_listen_fd_or_die(port);
+    uloop_accept(&l);
+
+    while (1) {
+	ring_enter(r, 1);
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+	    struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+	    uintptr_t data = cqe->user_data;
+	    int res = cqe->res;
+	    unsigned flags = cqe->flags;
+	    // hand the slot back before its result is acted on, which may
+	    // queue more work
+	    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	    if ((data & OP_MASK) == OP_ACCEPT)
+		uloop_accepted(&l, res, flags);
+	    else if ((data & OP_MASK) != OP_NONE)
+		uconn_complete(&l, (uconn_t *) (data & ~(uintptr_t) OP_MASK), data & OP_MASK, res);
+	}
+    }
+    return NULL;
+}
+
+//
+// Runs 'loops' io_uring loops on 'port', one in the calling thread; never
+// returns
+//
+void uring_run(int port, int loops) {
+    static int uring_port;
+    struct rlimit rl;
+
+    // one descriptor per connection: allow as many as we may
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);      // a vanished client is an error return, not a signal
+    signal(SIGCHLD, SIG_IGN);      // CGI children are never waited for
+
+    uring_port = port;
+    for (int i = 1; i < loops; i++) {
+	pthread_t p;
+	pthread_create_or_die(&p, NULL, uloop_run, &uring_port);
+	pthread_detach(p);
+    }
+    uloop_run(&uring_port);
+}
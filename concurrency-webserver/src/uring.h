@@ -0,0 +1,6 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+void uring_run(int port, int loops);
+
+#endif // __URING_H__
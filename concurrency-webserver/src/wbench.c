@@ -0,0 +1,286 @@
+//
+// wbench.c: a load generator for the web server, grown out of wclient.
+//
+// To run:
+//      wbench [-t threads] [-d seconds] [-r rate] [-k] [-H] host port urifile
+//
+// urifile lists one URI per line, each optionally followed by a weight (1
+// by default); every request picks a URI at random in proportion to the
+// weights.
+//
+// Each thread has one request outstanding at a time. In a closed loop, the
+// default, it sends the next request as soon as the previous response is in.
+// With -r, the threads together send 'rate' requests per second on a fixed
+// schedule (open loop). A request is then timed from when it was due rather
+// than from when it could go out, so a server that falls behind shows up in
+// the latencies instead of quietly slowing the load down.
+//
+// -k keeps each thread's connection alive from one request to the next.
+// -H prints the whole latency histogram after the percentiles.
+//
+
+#include <time.h>
+#include "io_helper.h"
+#include "client.h"
+#include "hist.h"
+
+#define MAXBUF (8192)
+
+//
+// Latencies are counted in microseconds in a log-linear histogram (hist.h):
+// exact below 64 us, and in 32 buckets per doubling above, so that every
+// bucket is within about 3% of the values it holds
+//
+#define HIST_SUB_BITS (5)
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct {
+    long counts[HIST_BUCKETS];
+    long requests;
+    long errors;
+    long shed;                     // errors that were a 503 from a loaded server
+    double sum;                    // of latencies, in seconds
+    double max;
+} stats_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    stats_t stats;
+} worker_t;
+
+static char *host;
+static struct sockaddr_in server_addr;  // resolved once: gethostbyname() is not thread-safe
+static int threads = 1;
+static double duration = 10;
+static double rate = 0;            // 0: closed loop
+static int keep_alive = 0;
+static double start, end;
+
+static char **uris;
+static double *weights;            // running totals, for the pick
+static int nuris = 0;
+
+static void stats_add(stats_t *s, double latency) {
+    s->counts[hist_index(latency * 1e6, HIST_SUB_BITS)]++;
+    s->requests++;
+    s->sum += latency;
+    if (latency > s->max)
+	s->max = latency;
+}
+
+static char *pick_uri(unsigned int *seed) {
+    double r = rand_r(seed) / (RAND_MAX + 1.0) * weights[nuris - 1];
+    int lo = 0, hi = nuris - 1;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (r < weights[mid])
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return uris[lo];
+}
+
+static void sleep_until(double t) {
+    struct timespec ts = { (time_t) t, (long) ((t - (time_t) t) * 1e9) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	;
+}
+
+static int bench_connect(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+	return -1;
+    if (connect(fd, (sockaddr_t *) &server_addr, sizeof(server_addr)) < 0) {
+	close_or_die(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static void *bench_worker(void *arg) {
+    worker_t *w = arg;
+    unsigned int seed = w->id * 7919 + 1;
+    double interval = rate > 0 ? threads / rate : 0;
+    double due = start + interval * w->id / threads;  // spread the threads out
+    int fd = -1;
+    rio_t rio;
+
+    while (1) {
+	double now = client_now();
+	if (rate > 0) {
+	    if (due >= end)
+		break;
+	    if (due > now)
+		sleep_until(due);
+	} else {
+	    if (now >= end)
+		break;
+	    due = now;
+	}
+
+	if (fd < 0) {
+	    if ((fd = bench_connect()) < 0) {
+		w->stats.errors++;
+		due += interval;
+		continue;
+	    }
+	    rio_init(&rio, fd);
+	}
+	int status = 0, rc = -1;
+	if (client_send(fd, host, pick_uri(&seed), keep_alive, 1) == 0)
+	    rc = client_discard(&rio, &status);
+	if (rc < 0 || status < 200 || status > 299) {
+	    w->stats.errors++;
+	    w->stats.shed += status == 503;
+	} else
+	    stats_add(&w->stats, client_now() - due);
+	if (rc <= 0) {
+	    close_or_die(fd);
+	    fd = -1;
+	}
+	due += interval;
+    }
+    if (fd >= 0)
+	close_or_die(fd);
+    return NULL;
+}
+
+//
+// Reads "uri [weight]" lines
+//
+static void load_uris(char *filename) {
+    char line[MAXBUF], uri[MAXBUF];
+    double weight, total = 0;
+    int max = 16;
+
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "wbench: cannot open %s\n", filename);
+	exit(1);
+    }
+    uris = malloc(max * sizeof(char *));
+    weights = malloc(max * sizeof(double));
+    assert(uris != NULL && weights != NULL);
+    while (fgets(line, MAXBUF, f)) {
+	int fields = sscanf(line, "%s %lf", uri, &weight);
+	if (fields < 1 || uri[0] == '#')
+	    continue;
+	if (fields < 2)
+	    weight = 1;
+	if (weight <= 0)
+	    continue;
+	if (nuris == max) {
+	    max *= 2;
+	    uris = realloc(uris, max * sizeof(char *));
+	    weights = realloc(weights, max * sizeof(double));
+	    assert(uris != NULL && weights != NULL);
+	}
+	total += weight;
+	uris[nuris] = strdup(uri);
+	weights[nuris++] = total;
+    }
+    fclose(f);
+    if (nuris == 0) {
+	fprintf(stderr, "wbench: no URIs in %s\n", filename);
+	exit(1);
+    }
+}
+
+static void report(stats_t *s, double elapsed, int histogram) {
+    double percentiles[] = { 50, 90, 99, 99.9 };
+    char *names[] = { "p50", "p90", "p99", "p999" };
+
+    printf("%d threads, %s, %s, %.1f s\n", threads,
+	   rate > 0 ? "open loop" : "closed loop", keep_alive ? "keep-alive" : "close", elapsed);
+    printf("  %ld requests  %ld errors (%ld 503)  %.1f requests/sec\n",
+	   s->requests, s->errors, s->shed, s->requests / elapsed);
+    if (s->requests == 0)
+	return;
+    printf("  latency  mean %.3f ms  max %.3f ms\n", s->sum / s->requests * 1000, s->max * 1000);
+    printf("          ");
+    for (int p = 0, i = 0; p < 4; p++) {
+	long target = (long) (s->requests * percentiles[p] / 100 + 0.999), seen = 0;
+	for (i = 0; i < HIST_BUCKETS; i++)
+	    if ((seen += s->counts[i]) >= target)
+		break;
+	printf(" %s %.3f ms", names[p], hist_upper(i, HIST_SUB_BITS) / 1000.0);
+    }
+    printf("\n");
+    if (histogram) {
+	printf("  up to (ms)     requests\n");
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	    if (s->counts[i])
+		printf("  %10.3f %12ld\n", hist_upper(i, HIST_SUB_BITS) / 1000.0, s->counts[i]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int c, histogram = 0;
+
+    while ((c = getopt(argc, argv, "t:d:r:kH")) != -1)
+	switch (c) {
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'd':
+	    duration = atof(optarg);
+	    break;
+	case 'r':
+	    rate = atof(optarg);
+	    break;
+	case 'k':
+	    keep_alive = 1;
+	    break;
+	case 'H':
+	    histogram = 1;
+	    break;
+	default:
+	    argc = 0;
+	}
+
+    if (argc - optind != 3 || threads < 1 || duration <= 0 || rate < 0) {
+	fprintf(stderr, "Usage: wbench [-t threads] [-d seconds] [-r rate] [-k] [-H] <host> <port> <urifile>\n");
+	exit(1);
+    }
+    host = argv[optind];
+    struct hostent *hp = gethostbyname(host);
+    if (hp == NULL) {
+	fprintf(stderr, "wbench: cannot resolve %s\n", host);
+	exit(1);
+    }
+    server_addr.sin_family = AF_INET;
+    memcpy(&server_addr.sin_addr.s_addr, hp->h_addr, hp->h_length);
+    server_addr.sin_port = htons(atoi(argv[optind + 1]));
+    load_uris(argv[optind + 2]);
+
+    // a server closing on us is counted as an error, not fatal
+    signal(SIGPIPE, SIG_IGN);
+
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    assert(workers != NULL);
+    start = client_now();
+    end = start + duration;
+    for (int i = 0; i < threads; i++) {
+	workers[i].id = i;
+	pthread_create_or_die(&workers[i].thread, NULL, bench_worker, &workers[i]);
+    }
+
+    stats_t *total = calloc(1, sizeof(stats_t));
+    assert(total != NULL);
+    for (int i = 0; i < threads; i++) {
+	stats_t *s = &workers[i].stats;
+	assert(pthread_join(workers[i].thread, NULL) == 0);
+	for (int b = 0; b < HIST_BUCKETS; b++)
+	    total->counts[b] += s->counts[b];
+	total->requests += s->requests;
+	total->errors += s->errors;
+	total->shed += s->shed;
+	total->sum += s->sum;
+	if (s->max > total->max)
+	    total->max = s->max;
+    }
+    report(total, client_now() - start, histogram);
+    exit(0);
+}
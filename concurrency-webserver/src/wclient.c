@@ -7,6 +7,14 @@
 // Sends one HTTP request to the specified HTTP server.
 // Prints out the HTTP response.
 //
+// Benchmark mode:
+//      client -n requests [-k] [-P depth] hostname portnumber filename
+//
+// Sends the request that many times, one after the other, and prints how
+// long they took instead of the responses. Each request gets a connection of
+// its own, unless -k keeps one connection alive for all of them; -P then
+// pipelines them, sending depth requests before reading any response.
+//
 // For testing your server, you will want to modify this client.  
 // For example:
 // You may want to make this multi-threaded so that you can 
@@ -20,36 +28,25 @@
 //
 
 #include "io_helper.h"
+#include "client.h"
 
 #define MAXBUF (8192)
 
-//
-// Send an HTTP request for the specified file 
-//
-void client_send(int fd, char *filename) {
-    char buf[MAXBUF];
-    char hostname[MAXBUF];
-    
-    gethostname_or_die(hostname, MAXBUF);
-    
-    /* Form and send the HTTP request */
-    sprintf(buf, "GET %s HTTP/1.1\n", filename);
-    sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
-    write_or_die(fd, buf, strlen(buf));
-}
-
 //
 // Read the HTTP response and print it out
 //
 void client_print(int fd) {
     char buf[MAXBUF];  
     int n;
+    rio_t rio;
+    
+    rio_init(&rio, fd);
     
     // Read and display the HTTP Header 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = readline_or_die(&rio, buf, MAXBUF);
     while (strcmp(buf, "\r\n") && (n > 0)) {
 	printf("Header: %s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	n = readline_or_die(&rio, buf, MAXBUF);
 	
 	// If you want to look for certain HTTP tags... 
 	// int length = 0;
@@ -59,31 +56,109 @@ void client_print(int fd) {
     }
     
     // Read and display the HTTP Body 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = readn_or_die(&rio, buf, MAXBUF);
     while (n > 0) {
-	printf("%s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	fwrite(buf, 1, n, stdout);
+	n = readn_or_die(&rio, buf, MAXBUF);
+    }
+}
+
+int client_cmp(const void *a, const void *b) {
+    double x = *(double *) a, y = *(double *) b;
+    return x < y ? -1 : x > y;
+}
+
+//
+// Benchmark mode: time each request, from connecting (if it needs a new
+// connection) or from sending its pipelined batch, to the end of its response
+//
+void client_bench(char *host, int port, char *filename, int requests, int keep_alive, int depth) {
+    double *latency = malloc(requests * sizeof(double));
+    int fd = -1, done = 0;
+    rio_t rio;
+    
+    assert(latency != NULL);
+    double start = client_now();
+    while (done < requests) {
+	double sent = client_now();
+	if (fd < 0) {
+	    fd = open_client_fd_or_die(host, port);
+	    rio_init(&rio, fd);
+	}
+	int batch = keep_alive && depth < requests - done ? depth : requests - done;
+	if (!keep_alive)
+	    batch = 1;
+	client_send(fd, host, filename, keep_alive, batch);
+	
+	int open = 1;
+	for (int i = 0; i < batch; i++) {
+	    int status;
+	    int rc = client_discard(&rio, &status);
+	    if (rc < 0 || (rc == 0 && i < batch - 1)) {
+		fprintf(stderr, "connection closed after %d responses\n", done);
+		exit(1);
+	    }
+	    latency[done++] = client_now() - sent;
+	    open = rc;
+	}
+	if (!open) {
+	    close_or_die(fd);
+	    fd = -1;
+	}
     }
+    double elapsed = client_now() - start;
+    if (fd >= 0)
+	close_or_die(fd);
+    
+    double sum = 0;
+    for (int i = 0; i < requests; i++)
+	sum += latency[i];
+    qsort(latency, requests, sizeof(double), client_cmp);
+    printf("%d requests %.3f s %.1f requests/sec  latency mean %.3f ms p50 %.3f ms p99 %.3f ms\n",
+	   requests, elapsed, requests / elapsed, sum / requests * 1000,
+	   latency[requests / 2] * 1000, latency[(requests * 99 + 99) / 100 - 1] * 1000);
+    free(latency);
 }
 
 int main(int argc, char *argv[]) {
     char *host, *filename;
     int port;
     int clientfd;
+    int c, requests = 0, keep_alive = 0, depth = 1;
+    
+    while ((c = getopt(argc, argv, "n:kP:")) != -1)
+	switch (c) {
+	case 'n':
+	    requests = atoi(optarg);
+	    break;
+	case 'k':
+	    keep_alive = 1;
+	    break;
+	case 'P':
+	    depth = atoi(optarg);
+	    break;
+	default:
+	    argc = 0;
+	}
     
-    if (argc != 4) {
-	fprintf(stderr, "Usage: %s <host> <port> <filename>\n", argv[0]);
+    if (argc - optind != 3 || requests < 0 || depth < 1) {
+	fprintf(stderr, "Usage: %s [-n requests] [-k] [-P depth] <host> <port> <filename>\n", argv[0]);
 	exit(1);
     }
     
-    host = argv[1];
-    port = atoi(argv[2]);
-    filename = argv[3];
+    host = argv[optind];
+    port = atoi(argv[optind + 1]);
+    filename = argv[optind + 2];
+    
+    if (requests > 0) {
+	client_bench(host, port, filename, requests, keep_alive, depth);
+	exit(0);
+    }
     
     /* Open a single connection to the specified host and port */
     clientfd = open_client_fd_or_die(host, port);
     
-    client_send(clientfd, filename);
+    client_send(clientfd, host, filename, 0, 1);
     client_print(clientfd);
     
     close_or_die(clientfd);
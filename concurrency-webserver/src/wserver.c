@@ -1,18 +1,87 @@
 #include <stdio.h>
 #include "request.h"
 #include "io_helper.h"
+#include "pool.h"
+#include "event.h"
+#include "uring.h"
+#include "cache.h"
+#include "cgi.h"
+#include "stats.h"
 
 char default_root[] = ".";
 
+enum { ENGINE_POOL, ENGINE_EPOLL, ENGINE_URING };
+
+static sigset_t report_set;
+static int report_interval = 0;    // seconds between summaries, 0: none
+
+//
+// SIGUSR1 is blocked in every thread but this one, which waits for it, or
+// for the next summary to be due
+//
+static void *report_thread(void *arg) {
+    struct timespec interval = { report_interval, 0 };
+    
+    while (1) {
+	int sig = report_interval ? sigtimedwait(&report_set, NULL, &interval) : sigwaitinfo(&report_set, NULL);
+	if (sig == SIGUSR1)
+	    cache_report(stderr);
+	stats_report(stderr);
+    }
+    return NULL;
+}
+
+static void report_init(void) {
+    pthread_t p;
+    
+    sigemptyset(&report_set);
+    sigaddset(&report_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &report_set, NULL);
+    pthread_create_or_die(&p, NULL, report_thread, NULL);
+    pthread_detach(p);
+}
+
+//
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-s <schedalg>] [-e <engine>]
+//           [-c <cache KiB>] [-w <cgi workers>] [-m <seconds>] [-q <queued>] [-l <ms>]
+//
+// The pool engine serves each connection from a worker thread; the epoll
+// engine runs one event loop per thread instead (one per core by default),
+// and has no use for -b and -s. The uring engine is laid out like the epoll
+// one, but makes its calls through io_uring (see uring.c).
+//
+// With -c, small static files are served from memory. Text files sent
+// gzip-compressed are kept compressed in memory either way: without -c, in
+// a few MiB of their own (see cache.c).
+//
+// With -q or -l, the pool engine sheds load: a connection that would make
+// more than that many wait in the buffer, or that arrives when one has
+// waited more than that many ms, is answered with a 503 at once.
 //
-// ./wserver [-d <basedir>] [-p <portnum>] 
+// Either engine counts what it serves (see stats.h). GET /__stats returns
+// the counts since startup; with -m, a summary of the last interval goes to
+// stderr every that many seconds. SIGUSR1 prints the cache counters and a
+// summary since the last one.
+//
+// With -w, the pool engine keeps up to that many processes of each CGI
+// program running and hands requests to them (see cgi.h) instead of
+// starting the program anew each time. The epoll and uring engines, which
+// must not wait for a CGI program, always start a new one.
 // 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
+    int threads = -1;
+    int buffers = 1;
+    int policy = POOL_FIFO;
+    int engine = ENGINE_POOL;
+    long cache_kib = 0;
+    int cgi_workers = 0;
+    int max_queued = 0;
+    int max_wait_ms = 0;
     
-    while ((c = getopt(argc, argv, "d:p:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:b:s:e:c:w:m:q:l:")) != -1)
 	switch (c) {
 	case 'd':
 	    root_dir = optarg;
@@ -20,22 +89,89 @@ int main(int argc, char *argv[]) {
 	case 'p':
 	    port = atoi(optarg);
 	    break;
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'b':
+	    buffers = atoi(optarg);
+	    break;
+	case 's':
+	    if (!strcmp(optarg, "FIFO"))
+		policy = POOL_FIFO;
+	    else if (!strcmp(optarg, "SFF"))
+		policy = POOL_SFF;
+	    else if (!strcmp(optarg, "SRPT"))
+		policy = POOL_SRPT;
+	    else {
+		fprintf(stderr, "schedalg must be one of FIFO, SFF or SRPT\n");
+		exit(1);
+	    }
+	    break;
+	case 'e':
+	    if (!strcmp(optarg, "pool"))
+		engine = ENGINE_POOL;
+	    else if (!strcmp(optarg, "epoll"))
+		engine = ENGINE_EPOLL;
+	    else if (!strcmp(optarg, "uring"))
+		engine = ENGINE_URING;
+	    else {
+		fprintf(stderr, "engine must be one of pool, epoll or uring\n");
+		exit(1);
+	    }
+	    break;
+	case 'c':
+	    cache_kib = atol(optarg);
+	    break;
+	case 'w':
+	    cgi_workers = atoi(optarg);
+	    break;
+	case 'm':
+	    report_interval = atoi(optarg);
+	    break;
+	case 'q':
+	    max_queued = atoi(optarg);
+	    break;
+	case 'l':
+	    max_wait_ms = atoi(optarg);
+	    break;
 	default:
-	    fprintf(stderr, "usage: wserver [-d basedir] [-p port]\n");
+	    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffers] [-s schedalg] [-e engine] [-c cache_kib] [-w cgi_workers] [-m seconds] [-q queued] [-l ms]\n");
 	    exit(1);
 	}
 
+    if (threads == -1)
+	threads = engine != ENGINE_POOL ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (threads < 1 || buffers < 1) {
+	fprintf(stderr, "threads and buffers must be positive integers\n");
+	exit(1);
+    }
+    if (cache_kib < 0 || cgi_workers < 0 || report_interval < 0 || max_queued < 0 || max_wait_ms < 0) {
+	fprintf(stderr, "cache size, cgi workers, report interval and queue limits must not be negative\n");
+	exit(1);
+    }
+
     // run out of this directory
     chdir_or_die(root_dir);
 
-    // now, get to work
+    stats_init();
+    cache_init(cache_kib * 1024);
+    cgi_init(cgi_workers);
+    report_init();
+
+    if (engine == ENGINE_EPOLL)
+	event_run(port, threads);
+    if (engine == ENGINE_URING)
+	uring_run(port, threads);
+
+    // now, get to work: the master thread accepts, the pool serves
+    signal(SIGPIPE, SIG_IGN);      // a vanished client is an error return, not a signal
+    pool_init(threads, buffers, policy, max_queued, max_wait_ms);
     int listen_fd = open_listen_fd_or_die(port);
     while (1) {
 	struct sockaddr_in client_addr;
 	int client_len = sizeof(client_addr);
 	int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
-	request_handle(conn_fd);
-	close_or_die(conn_fd);
+	pool_put(conn_fd);
     }
     return 0;
 }
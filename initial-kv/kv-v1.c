@@ -12,7 +12,8 @@
 //   - d,<key>: Delete entry by key
 //   - g,<key>: Get single entry by key
 //   - p,<key>,<value>: Insert or update entry
-// Persistence is handled via atomic file replacement using `rename()`.
+// Persistence is handled via atomic file replacement using `rename()`, with
+// fsync() on the file and its directory.
 // Build: gcc -Wall -Wextra -pedantic -std=c11 -o kvstore kvstore.c
 // Usage: ./kvstore <option>,[key],[value]...
 // Example: ./kvstore p,1,hello g,1
@@ -20,6 +21,7 @@
 // =============================================================================
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -252,10 +254,12 @@ void save_db_to_file(kv_t **head, const char *filename) {
     return;
   }
 
+  // FIX: The temporary file has to live next to the database: rename() cannot
+  // move a file across filesystems, and /tmp often is a different one.
   char temp_filename[256];
-  snprintf(temp_filename, sizeof(temp_filename), "/tmp/kvXXXXXX%s", filename);
+  snprintf(temp_filename, sizeof(temp_filename), "%s.XXXXXX", filename);
 
-  int temp_fd = mkstemps(temp_filename, strlen(filename));
+  int temp_fd = mkstemp(temp_filename);
   if (temp_fd == -1) {
     perror("Failed to create temporary file");
     exit(EXIT_FAILURE);
@@ -272,7 +276,13 @@ void save_db_to_file(kv_t **head, const char *filename) {
   for (kv_t *curr = *head; curr; curr = curr->next) {
     fprintf(temp_fp, "%d,%s\n", curr->key, curr->value);
   }
-  fclose(temp_fp);
+  // The new contents must be on disk before the rename can publish them,
+  // otherwise a crash may leave an empty file under the old name.
+  if (fflush(temp_fp) != 0 || fsync(temp_fd) != 0 || fclose(temp_fp) != 0) {
+    perror("Failed to write temporary file");
+    unlink(temp_filename);
+    exit(EXIT_FAILURE);
+  }
 
   // NOTE: How rename() works?
   // Think of it like moving a photograph into a picture frame. When you place
@@ -289,6 +299,14 @@ void save_db_to_file(kv_t **head, const char *filename) {
     unlink(temp_filename);
     exit(EXIT_FAILURE);
   }
+
+  // The rename itself only survives a crash once the directory is synced.
+  int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0 || fsync(dir_fd) != 0) {
+    perror("Failed to sync database directory");
+    exit(EXIT_FAILURE);
+  }
+  close(dir_fd);
 }
 // =============================================================================
 // Utility Functions
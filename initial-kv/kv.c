@@ -1,257 +1,1662 @@
 /* ostep-projects/initial-kv/kv.c */
 // Created on: Wed Sep 10 03:09:52 +01 2025
 
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np()
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+
+#include "kv.h"
 #ifndef BUFSIZ
 #define BUFSIZ 4096
 #endif /* ifndef BUFSIZ */
 // =============================================================================
+// Arena allocator for index records and values. Memory is bump
+// allocated out of large blocks and only handed back to malloc() all at once
+// (clear or exit). Freed chunks, mostly overwritten values, go onto
+// size-class free lists and are reused by later allocations of that class.
+// =============================================================================
+#define KVARENA_BLOCK_SIZE (1 << 20)
+#define KVARENA_SMALL_MAX 1024 // classes step by 16 bytes up to here,
+#define KVARENA_SMALL_CLASSES (KVARENA_SMALL_MAX / 16)
+#define KVARENA_CLASSES (KVARENA_SMALL_CLASSES + 48) // then by powers of two
+
+typedef struct kvblock {
+  struct kvblock *next;
+  size_t size;
+  size_t used;
+  _Alignas(16) char data[];
+} kvblock_t;
+
+typedef struct kvchunk {
+  struct kvchunk *next;
+} kvchunk_t;
+
+typedef struct {
+  kvblock_t *blocks; // head is the block being bump allocated from
+  kvchunk_t *free_lists[KVARENA_CLASSES];
+  size_t reserved;  // bytes obtained from malloc() for blocks
+  size_t allocated; // bytes bump allocated out of the blocks
+  size_t live;      // bytes currently handed out
+} kvarena_t;
+
+// Round size up to its class and return the class index.
+static size_t kvarena_class(size_t size, size_t *rounded) {
+  if (size <= KVARENA_SMALL_MAX) {
+    *rounded = size ? (size + 15) & ~(size_t)15 : 16;
+    return *rounded / 16 - 1;
+  }
+  size_t cls = KVARENA_SMALL_CLASSES;
+  for (*rounded = KVARENA_SMALL_MAX * 2; *rounded < size; *rounded <<= 1) {
+    cls++;
+  }
+  return cls;
+}
+
+static kvblock_t *kvarena_new_block(kvarena_t *a, size_t size) {
+  kvblock_t *b = malloc(sizeof(*b) + size);
+  if (!b) {
+    perror("malloc failed to allocate arena block");
+    exit(EXIT_FAILURE);
+  }
+  b->size = size;
+  b->used = 0;
+  a->reserved += size;
+  return b;
+}
+
+void *kvarena_alloc(kvarena_t *a, size_t size) {
+  size_t rounded;
+  size_t cls = kvarena_class(size, &rounded);
+  a->live += rounded;
+
+  kvchunk_t *chunk = a->free_lists[cls];
+  if (chunk) {
+    a->free_lists[cls] = chunk->next;
+    return chunk;
+  }
+
+  a->allocated += rounded;
+  if (rounded > KVARENA_BLOCK_SIZE / 4) {
+    // Big values get a block of their own behind the current one, so the
+    // tail of the current block is not wasted.
+    kvblock_t *b = kvarena_new_block(a, rounded);
+    b->used = rounded;
+    if (a->blocks) {
+      b->next = a->blocks->next;
+      a->blocks->next = b;
+    } else {
+      b->next = NULL;
+      a->blocks = b;
+    }
+    return b->data;
+  }
+  if (!a->blocks || a->blocks->size - a->blocks->used < rounded) {
+    kvblock_t *b = kvarena_new_block(a, KVARENA_BLOCK_SIZE);
+    b->next = a->blocks;
+    a->blocks = b;
+  }
+  void *p = a->blocks->data + a->blocks->used;
+  a->blocks->used += rounded;
+  return p;
+}
+
+// size must be the size the chunk was allocated with.
+void kvarena_free(kvarena_t *a, void *p, size_t size) {
+  if (!p) {
+    return;
+  }
+  size_t rounded;
+  size_t cls = kvarena_class(size, &rounded);
+  kvchunk_t *chunk = p;
+  chunk->next = a->free_lists[cls];
+  a->free_lists[cls] = chunk;
+  a->live -= rounded;
+}
+
+char *kvarena_memdup(kvarena_t *a, const void *p, size_t len) {
+  return memcpy(kvarena_alloc(a, len), p, len);
+}
+
+void kvarena_reset(kvarena_t *a) {
+  for (kvblock_t *b = a->blocks; b; b = a->blocks) {
+    a->blocks = b->next;
+    free(b);
+  }
+  memset(a, 0, sizeof(*a));
+}
+
+void kvarena_report(const kvarena_t *a, FILE *out) {
+  fprintf(out,
+          "arena: %zu bytes reserved, %zu allocated, %zu live, %zu on free "
+          "lists (%.1f%% of reserved live)\n",
+          a->reserved, a->allocated, a->live, a->allocated - a->live,
+          a->reserved ? 100.0 * a->live / a->reserved : 100.0);
+}
+// =============================================================================
+// Keys are signed 64-bit integers. Values are arbitrary bytes that carry their
+// length, so they may hold commas, newlines or NULs.
+typedef struct {
+  const char *data;
+  size_t len;
+} kvvalue_t;
+
 typedef struct keyValue {
-  int key;
-  char *value;
-  struct keyValue *next;
+  int64_t key;
+  int level;   // number of skiplist links in next[]
+  size_t len;  // of value
+  char *value; // NULL marks a deleted key (see kvstore_t)
+  struct keyValue *next[];
 } keyvalues_t;
+
+// Open-addressing (linear probing) hash index keyed on the record key. The slot
+// keeps a copy of the key so a probe never has to chase the record pointer.
+// A slot with a NULL rec is empty; deletion uses backward shifting, so there
+// are no deleted-slot markers and probe chains stay short.
+typedef struct {
+  int64_t key;
+  keyvalues_t *rec;
+} kvslot_t;
+
+// The same records are also linked into a skiplist in key order, so range
+// scans seek in O(log n) instead of sorting the whole index.
+#define KVDB_MAX_LEVEL 32
+
+typedef struct {
+  kvslot_t *slots;
+  size_t cap;      // always a power of two
+  size_t count;    // occupied slots
+  kvarena_t arena; // records and their values
+  keyvalues_t *head[KVDB_MAX_LEVEL]; // skiplist links out of the head
+  int level;                         // levels in use
+  uint64_t rng;                      // xorshift state for node levels
+} kvdb_t;
+
+#define KVDB_MIN_CAP 16
+// =============================================================================
+static size_t kvdb_hash(int64_t key, size_t cap) {
+  // Fibonacci hashing: keys are often dense (1, 2, 3, ...), so mix them
+  // before masking instead of using the low bits as they are. The high half
+  // is folded in first, or keys differing only there would all collide.
+  uint64_t h = (uint64_t)key;
+  h = (h ^ (h >> 32)) * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h >> 32) & (cap - 1);
+}
+
+// Returns the slot holding key, or the empty slot where it would go.
+static kvslot_t *kvdb_probe(const kvdb_t *db, int64_t key) {
+  size_t i = kvdb_hash(key, db->cap);
+  while (db->slots[i].rec && db->slots[i].key != key) {
+    i = (i + 1) & (db->cap - 1);
+  }
+  return &db->slots[i];
+}
+
+static void kvdb_resize(kvdb_t *db, size_t newcap) {
+  kvslot_t *old = db->slots;
+  size_t oldcap = db->cap;
+
+  db->slots = calloc(newcap, sizeof(*db->slots));
+  if (!db->slots) {
+    perror("calloc failed to allocate hash index");
+    exit(EXIT_FAILURE);
+  }
+  db->cap = newcap;
+  for (size_t i = 0; i < oldcap; i++) {
+    if (old[i].rec) {
+      *kvdb_probe(db, old[i].key) = old[i];
+    }
+  }
+  free(old);
+}
+
+keyvalues_t *kvdb_get(const kvdb_t *db, int64_t key) {
+  if (!db->cap) {
+    return NULL;
+  }
+  return kvdb_probe(db, key)->rec;
+}
+
+static void kvdb_free_value(kvdb_t *db, keyvalues_t *rec) {
+  kvarena_free(&db->arena, rec->value, rec->len);
+}
+
+static size_t kvrec_size(int level) {
+  return sizeof(keyvalues_t) + level * sizeof(keyvalues_t *);
+}
+
+// Return a record unlinked by kvdb_remove() to the arena.
+void kvdb_free_rec(kvdb_t *db, keyvalues_t *rec) {
+  kvdb_free_value(db, rec);
+  kvarena_free(&db->arena, rec, kvrec_size(rec->level));
+}
+
+// Each level holds a quarter of the nodes of the one below.
+static int kvdb_random_level(kvdb_t *db) {
+  if (!db->rng) {
+    db->rng = 0x2545F4914F6CDD1DULL;
+  }
+  db->rng ^= db->rng << 13;
+  db->rng ^= db->rng >> 7;
+  db->rng ^= db->rng << 17;
+
+  int level = 1;
+  for (uint64_t r = db->rng; !(r & 3) && level < KVDB_MAX_LEVEL; r >>= 2) {
+    level++;
+  }
+  return level;
+}
+
+// Fill update[l] with the link at level l that points at the first node
+// whose key is >= key.
+static void kvdb_skip_search(kvdb_t *db, int64_t key,
+                             keyvalues_t **update[KVDB_MAX_LEVEL]) {
+  keyvalues_t **links = db->head;
+  for (int l = db->level - 1; l >= 0; l--) {
+    while (links[l] && links[l]->key < key) {
+      links = links[l]->next;
+    }
+    update[l] = &links[l];
+  }
+}
+
+// First record whose key is >= key, in O(log n).
+const keyvalues_t *kvdb_seek(const kvdb_t *db, int64_t key) {
+  keyvalues_t *const *links = db->head;
+  for (int l = db->level - 1; l >= 0; l--) {
+    while (links[l] && links[l]->key < key) {
+      links = links[l]->next;
+    }
+  }
+  return links[0];
+}
+
+// Insert or overwrite. Takes ownership of value, len bytes that must come
+// from the index's arena (or be NULL).
+void kvdb_put(kvdb_t *db, int64_t key, char *value, size_t len) {
+  // Keep the load factor at or below 3/4.
+  if ((db->count + 1) * 4 > db->cap * 3) {
+    kvdb_resize(db, db->cap ? db->cap * 2 : KVDB_MIN_CAP);
+  }
+
+  kvslot_t *slot = kvdb_probe(db, key);
+  if (slot->rec) {
+    kvdb_free_value(db, slot->rec);
+    slot->rec->value = value;
+    slot->rec->len = len;
+    return;
+  }
+
+  int level = kvdb_random_level(db);
+  keyvalues_t *node = kvarena_alloc(&db->arena, kvrec_size(level));
+  node->key = key;
+  node->level = level;
+  node->len = len;
+  node->value = value;
+  slot->key = key;
+  slot->rec = node;
+  db->count++;
+
+  keyvalues_t **update[KVDB_MAX_LEVEL];
+  kvdb_skip_search(db, key, update);
+  for (; db->level < level; db->level++) {
+    update[db->level] = &db->head[db->level];
+  }
+  for (int l = 0; l < level; l++) {
+    node->next[l] = *update[l];
+    *update[l] = node;
+  }
+}
+
+// Unlinks the record for key and returns it (caller frees), or NULL.
+keyvalues_t *kvdb_remove(kvdb_t *db, int64_t key) {
+  if (!db->cap) {
+    return NULL;
+  }
+  size_t mask = db->cap - 1;
+  kvslot_t *slot = kvdb_probe(db, key);
+  keyvalues_t *rec = slot->rec;
+  if (!rec) {
+    return NULL;
+  }
+
+  // Backward-shift deletion: pull later members of the probe chain into the
+  // hole as long as that does not move them before their home slot.
+  size_t hole = (size_t)(slot - db->slots);
+  for (size_t i = (hole + 1) & mask; db->slots[i].rec; i = (i + 1) & mask) {
+    size_t home = kvdb_hash(db->slots[i].key, db->cap);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      db->slots[hole] = db->slots[i];
+      hole = i;
+    }
+  }
+  db->slots[hole].rec = NULL;
+  db->count--;
+
+  keyvalues_t **update[KVDB_MAX_LEVEL];
+  kvdb_skip_search(db, key, update);
+  for (int l = 0; l < rec->level; l++) {
+    *update[l] = rec->next[l];
+  }
+  return rec;
+}
+
+void kvdb_clear(kvdb_t *db) {
+  kvarena_reset(&db->arena);
+  free(db->slots);
+  db->slots = NULL;
+  db->cap = 0;
+  db->count = 0;
+  memset(db->head, 0, sizeof(db->head));
+  db->level = 0;
+}
+
+// =============================================================================
+// Binary snapshot. The file is mmap()ed read-only and queried in place with a
+// binary search, so opening a store costs the same whatever its size.
+//
+// Layout (host byte order, every section 8-byte aligned):
+//   kvsnap_header_t | int64_t keys[count] | uint64_t offs[count + 1] | heap
+// Keys are sorted ascending. Value i is the bytes heap[offs[i] .. offs[i + 1]).
+// Version 1 snapshots, with int32_t keys and NUL-terminated values, are still
+// read; the next compaction rewrites them as version 2.
+// =============================================================================
+#define KVSNAP_MAGIC "OSTEPKV\n"
+#define KVSNAP_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t keys_off;
+  uint64_t offs_off;
+  uint64_t heap_off;
+  uint64_t heap_size;
+  uint64_t padding;
+} kvsnap_header_t;
+
+typedef struct {
+  void *base; // NULL when no snapshot is mapped
+  size_t size;
+  uint64_t count;
+  const int64_t *keys;
+  const int32_t *keys32; // instead of keys in a version 1 snapshot
+  const uint64_t *offs;
+  const char *heap;
+  uint64_t heap_size;
+  uint64_t nul; // 1 if values are followed by a NUL (version 1)
+} kvsnap_t;
+
+// Map the snapshot. Returns false if there is none; exits if it is corrupted.
+bool kvsnap_open(kvsnap_t *snap, const char *filename) {
+  memset(snap, 0, sizeof(*snap));
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    // This is a normal condition: no snapshot written yet
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("fstat() failed on snapshot");
+    exit(EXIT_FAILURE);
+  }
+  if ((size_t)st.st_size < sizeof(kvsnap_header_t)) {
+    fprintf(stderr, "Error: Snapshot '%s' is truncated\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("mmap() failed on snapshot");
+    exit(EXIT_FAILURE);
+  }
+
+  const kvsnap_header_t *hdr = base;
+  uint64_t size = st.st_size;
+  uint64_t key_size = hdr->version == 1 ? sizeof(int32_t) : sizeof(int64_t);
+  // Check every section lies inside the file before trusting any offset.
+  // The value offsets inside offs[] are checked as each is read, in
+  // kvsnap_value(), so that opening does not have to walk them all.
+  if (memcmp(hdr->magic, KVSNAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version < 1 || hdr->version > KVSNAP_VERSION ||
+      hdr->count > size / key_size || hdr->keys_off != sizeof(*hdr) ||
+      hdr->offs_off > size || hdr->offs_off % 8 || hdr->heap_off > size ||
+      hdr->keys_off + hdr->count * key_size > hdr->offs_off ||
+      hdr->offs_off + (hdr->count + 1) * sizeof(uint64_t) > hdr->heap_off ||
+      hdr->heap_off + hdr->heap_size != size) {
+    fprintf(stderr, "Error: Snapshot '%s' is corrupted\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  snap->base = base;
+  snap->size = size;
+  snap->count = hdr->count;
+  if (hdr->version == 1) {
+    snap->keys32 = (const int32_t *)((const char *)base + hdr->keys_off);
+    snap->nul = 1;
+  } else {
+    snap->keys = (const int64_t *)((const char *)base + hdr->keys_off);
+  }
+  snap->offs = (const uint64_t *)((const char *)base + hdr->offs_off);
+  snap->heap = (const char *)base + hdr->heap_off;
+  snap->heap_size = hdr->heap_size;
+  if (snap->offs[snap->count] != hdr->heap_size) {
+    fprintf(stderr, "Error: Snapshot '%s' is corrupted\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+void kvsnap_close(kvsnap_t *snap) {
+  if (snap->base) {
+    munmap(snap->base, snap->size);
+  }
+  memset(snap, 0, sizeof(*snap));
+}
+
+static inline int64_t kvsnap_key(const kvsnap_t *snap, uint64_t i) {
+  return snap->keys ? snap->keys[i] : snap->keys32[i];
+}
+
+// Exits if the value's offsets do not make a slice of the heap.
+static inline kvvalue_t kvsnap_value(const kvsnap_t *snap, uint64_t i) {
+  uint64_t lo = snap->offs[i], hi = snap->offs[i + 1];
+  if (lo > hi || hi > snap->heap_size || hi - lo < snap->nul) {
+    fprintf(stderr, "Error: Snapshot is corrupted at value %" PRIu64 "\n", i);
+    exit(EXIT_FAILURE);
+  }
+  return (kvvalue_t){snap->heap + lo, hi - lo - snap->nul};
+}
+
+// Index of the first key >= key.
+uint64_t kvsnap_lower_bound(const kvsnap_t *snap, int64_t key) {
+  uint64_t lo = 0, hi = snap->count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (kvsnap_key(snap, mid) < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+bool kvsnap_find(const kvsnap_t *snap, int64_t key, kvvalue_t *value) {
+  uint64_t i = kvsnap_lower_bound(snap, key);
+  if (i < snap->count && kvsnap_key(snap, i) == key) {
+    *value = kvsnap_value(snap, i);
+    return true;
+  }
+  return false;
+}
 // =============================================================================
-void dbmanager(keyvalues_t **head, char *option, int key, char *value) {
-  // Either of chars in: "acdgp"
+// Striped reader-writer lock for the threaded server. Each thread read-locks
+// only its own stripe, so concurrent lookups neither wait for each other nor
+// bounce a shared lock word between cores; a writer takes every stripe, in
+// order. One-shot and batch runs only ever take it uncontended.
+// =============================================================================
+#define KVLOCK_STRIPES 16
+
+typedef struct {
+  _Alignas(64) pthread_rwlock_t rw; // a cache line per stripe
+} kvstripe_t;
+
+typedef struct {
+  kvstripe_t stripes[KVLOCK_STRIPES];
+} kvlock_t;
+
+static atomic_uint kvlock_next_stripe;
+static _Thread_local int kvlock_stripe = -1;
+
+void kvlock_init(kvlock_t *l) {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  // With mostly lookups, a reader-preferring lock would starve the writers.
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  for (int i = 0; i < KVLOCK_STRIPES; i++) {
+    pthread_rwlock_init(&l->stripes[i].rw, &attr);
+  }
+  pthread_rwlockattr_destroy(&attr);
+}
+
+static pthread_rwlock_t *kvlock_mine(kvlock_t *l) {
+  if (kvlock_stripe < 0) {
+    kvlock_stripe = atomic_fetch_add(&kvlock_next_stripe, 1) % KVLOCK_STRIPES;
+  }
+  return &l->stripes[kvlock_stripe].rw;
+}
+
+void kvlock_rdlock(kvlock_t *l) { pthread_rwlock_rdlock(kvlock_mine(l)); }
+
+void kvlock_rdunlock(kvlock_t *l) { pthread_rwlock_unlock(kvlock_mine(l)); }
+
+void kvlock_wrlock(kvlock_t *l) {
+  for (int i = 0; i < KVLOCK_STRIPES; i++) {
+    pthread_rwlock_wrlock(&l->stripes[i].rw);
+  }
+}
+
+void kvlock_wrunlock(kvlock_t *l) {
+  for (int i = KVLOCK_STRIPES - 1; i >= 0; i--) {
+    pthread_rwlock_unlock(&l->stripes[i].rw);
+  }
+}
+// =============================================================================
+// The store: the mapped snapshot overlaid by the hash index of records
+// changed since it was written. A NULL value in the index is a tombstone that
+// hides the snapshot's copy of a deleted key.
+// =============================================================================
+typedef struct {
+  kvdb_t mem;
+  kvsnap_t snap;
+  size_t live;  // visible records
+  kvlock_t lock; // held around every command (see run_command())
+} kvstore_t;
+
+// Returns false if key is not visible; value may be NULL.
+bool kvstore_get(const kvstore_t *st, int64_t key, kvvalue_t *value) {
+  kvvalue_t v;
+  keyvalues_t *rec = kvdb_get(&st->mem, key);
+  if (!rec) {
+    return kvsnap_find(&st->snap, key, value ? value : &v);
+  }
+  if (rec->value && value) {
+    *value = (kvvalue_t){rec->value, rec->len};
+  }
+  return rec->value;
+}
+
+// Insert or overwrite with a copy of the len bytes at value.
+void kvstore_put(kvstore_t *st, int64_t key, const char *value, size_t len) {
+  if (!kvstore_get(st, key, NULL)) {
+    st->live++;
+  }
+  kvdb_put(&st->mem, key, kvarena_memdup(&st->mem.arena, value, len), len);
+}
+
+// Returns false if there was no such key.
+bool kvstore_del(kvstore_t *st, int64_t key) {
+  kvvalue_t v;
+  if (!kvstore_get(st, key, NULL)) {
+    return false;
+  }
+  if (kvsnap_find(&st->snap, key, &v)) {
+    kvdb_put(&st->mem, key, NULL, 0);
+  } else {
+    kvdb_free_rec(&st->mem, kvdb_remove(&st->mem, key));
+  }
+  st->live--;
+  return true;
+}
+
+// Dropping the mapping hides the whole snapshot; the file itself is replaced
+// at the next compaction.
+void kvstore_clear(kvstore_t *st) {
+  kvdb_clear(&st->mem);
+  kvsnap_close(&st->snap);
+  st->live = 0;
+}
+
+// Key-ordered walk over the visible records: a merge of the snapshot with
+// the index's skiplist, where the index wins ties and tombstones are skipped.
+typedef struct {
+  const kvstore_t *st;
+  const keyvalues_t *mem; // next index record
+  uint64_t si;            // next snapshot record
+} kviter_t;
+
+// Start the walk at the first key >= lo: O(log n) in both sources.
+void kviter_init(kviter_t *it, const kvstore_t *st, int64_t lo) {
+  it->st = st;
+  it->mem = kvdb_seek(&st->mem, lo);
+  it->si = kvsnap_lower_bound(&st->snap, lo);
+}
+
+bool kviter_next(kviter_t *it, int64_t *key, kvvalue_t *value) {
+  const kvsnap_t *snap = &it->st->snap;
+  for (;;) {
+    const keyvalues_t *rec = it->mem;
+    bool has_snap = it->si < snap->count;
+    if (!rec && !has_snap) {
+      return false;
+    }
+    int64_t skey = has_snap ? kvsnap_key(snap, it->si) : 0;
+    if (!rec || (has_snap && skey < rec->key)) {
+      *key = skey;
+      *value = kvsnap_value(snap, it->si);
+      it->si++;
+      return true;
+    }
+
+    it->mem = rec->next[0];
+    if (has_snap && skey == rec->key) {
+      it->si++;
+    }
+    if (rec->value) {
+      *key = rec->key;
+      *value = (kvvalue_t){rec->value, rec->len};
+      return true;
+    }
+  }
+}
+// =============================================================================
+// Values go out as raw bytes after "key,". Binary values are better read
+// back with 'G', whose reply carries their length.
+static void print_record(FILE *out, int64_t key, kvvalue_t v) {
+  fprintf(out, "%" PRId64 ",", key);
+  fwrite(v.data, 1, v.len, out);
+  fputc('\n', out);
+}
+
+void dbmanager(kvstore_t *st, char *option, int64_t key,
+               const kvvalue_t *value, FILE *out) {
+  // Either of chars in: "acdgprsGP"
   switch (option[0]) {
   case 'a': { // Get all key value
-    if (*head == NULL) {
-      // FIX: This notification conflict with the first fopen() call error
-      // notification
-      /* printf("Database empty.\n"); */
-    } else {
-      for (keyvalues_t *curr = *head; curr; curr = curr->next) {
-        printf("%d,%s\n", curr->key, curr->value);
-      }
+    // FIX: An empty database prints nothing: a notification would conflict
+    // with the first fopen() call error notification
+    kviter_t it;
+    kvvalue_t v;
+    kviter_init(&it, st, INT64_MIN);
+    while (kviter_next(&it, &key, &v)) {
+      print_record(out, key, v);
     }
     break;
   }
   case 'c': { // Clear all key value
-    printf("Clearing database.\n");
-    for (keyvalues_t *curr = *head; curr; curr = *head) {
-      *head = curr->next;
-      free(curr->value);
-      free(curr);
-    }
+    fprintf(out, "Clearing database.\n");
+    kvstore_clear(st);
     break;
   }
   case 'd': { // Delete single key
-    if (*head == NULL) {
-      printf("Could not delete entry %d: Database already empty.\n", key);
-      return;
-    }
-
-    keyvalues_t *curr = *head;
-    if (curr->key == key) {
-      *head = curr->next;
-      printf("Deleting: %d,%s\n", curr->key, curr->value);
-      free(curr->value);
-      free(curr);
+    if (st->live == 0) {
+      fprintf(out,
+              "Could not delete entry %" PRId64 ": Database already empty.\n",
+              key);
       return;
     }
 
-    keyvalues_t *prev = NULL;
-    while (curr && curr->key != key) {
-      prev = curr;
-      curr = curr->next;
-    }
-
-    if (!curr) {
-      printf("Could not delete entry %d: No such entry.\n", key);
+    kvvalue_t v;
+    if (!kvstore_get(st, key, &v)) {
+      fprintf(out, "Could not delete entry %" PRId64 ": No such entry.\n", key);
     } else {
-      prev->next = curr->next;
-      printf("Deleting: %d,%s\n", curr->key, curr->value);
-      free(curr->value);
-      free(curr);
+      fprintf(out, "Deleting: ");
+      print_record(out, key, v);
+      kvstore_del(st, key);
     }
     break;
   }
   case 'g': { // Get single key
-    keyvalues_t *curr = NULL;
-    for (curr = *head; curr && curr->key != key; curr = curr->next) {
+    kvvalue_t v;
+    if (kvstore_get(st, key, &v)) {
+      print_record(out, key, v);
+    } else {
+      fprintf(out, "%" PRId64 " not found\n", key);
     }
-    if (curr) {
-      printf("%d,%s\n", curr->key, curr->value);
+    break;
+  }
+  case 'G': { // Get single key, framed as "key,len\n" + len bytes + "\n"
+    kvvalue_t v;
+    if (kvstore_get(st, key, &v)) {
+      fprintf(out, "%" PRId64 ",%zu\n", key, v.len);
+      fwrite(v.data, 1, v.len, out);
+      fputc('\n', out);
     } else {
-      printf("%d not found\n", key);
+      fprintf(out, "%" PRId64 " not found\n", key);
+    }
+    break;
+  }
+  case 'p':
+  case 'P': { // Put single key value
+    // WARNING: The incoming value is char* on the stack: the store copies it
+    kvstore_put(st, key, value->data, value->len);
+    break;
+  }
+  case 'r': { // Get keys in [key, value): an omitted end means no bound
+    kviter_t it;
+    kvvalue_t v;
+    // run_command() has checked the end is a NUL-terminated number.
+    int64_t hi = value ? strtoll(value->data, NULL, 10) : 0;
+    kviter_init(&it, st, key);
+    while (kviter_next(&it, &key, &v) && (!value || key < hi)) {
+      print_record(out, key, v);
     }
     break;
   }
-  case 'p': { // Put single key value
-    // WARNING: The incoming value is char* on the stack
-    char *heap_value = malloc(strlen(value) + 1);
-    if (!heap_value) {
-      perror("malloc failed to allocated value memory");
+  case 's': { // Allocator statistics
+    kvarena_report(&st->mem.arena, out);
+    break;
+  }
+  }
+}
+// =============================================================================
+// Persistence: a binary snapshot plus an append-only log of the put, delete
+// and clear operations applied since that snapshot. Startup maps the snapshot and
+// replays the log; an invocation that changes the database only appends to
+// the log. The log is folded back into a fresh snapshot once it outgrows it.
+// =============================================================================
+#ifndef KV_COMPACT_MIN_BYTES
+#define KV_COMPACT_MIN_BYTES (64 * 1024)
+#endif /* ifndef KV_COMPACT_MIN_BYTES */
+
+typedef struct {
+  const char *snapname;
+  const char *legacyname; // plain-text "key,value" database, imported once
+  const char *logname;
+  FILE *log_fp; // opened lazily on the first mutation
+  off_t log_bytes;
+  bool force_compact; // a 'c' ran or a legacy file was imported
+  bool batch;         // log_fp is an in-memory buffer (see run_batch())
+  char *batch_buf;
+  size_t batch_len;
+  bool log_created; // the log's directory entry is not durable yet
+  size_t records;   // records appended to the log
+  size_t synced;    // of those, records known to be on disk
+  atomic_size_t syncs;       // fsync() calls, log and snapshot alike
+  pthread_mutex_t log_lock;  // log_fp and the fields above it
+  pthread_mutex_t sync_lock; // one log fdatasync() at a time, and synced
+} kvfiles_t;
+
+static off_t file_size(const char *filename) {
+  struct stat st;
+  return stat(filename, &st) == 0 ? st.st_size : 0;
+}
+
+// Import the plain-text database of earlier versions. Returns false if there
+// is none.
+bool load_legacy(kvstore_t *st, const char *filename) {
+  FILE *db_fp = fopen(filename, "r");
+  if (!db_fp) {
+    // This is a normal condition: fail silently
+    return false;
+  }
+
+  char buffer[BUFSIZ];
+  char *line = NULL;
+  size_t linelen = 0;
+  while (fgets(buffer, BUFSIZ, db_fp)) {
+    size_t chunklen = strlen(buffer);
+    char *temp = realloc(line, linelen + chunklen + 1);
+    if (!temp) {
+      perror("realloc() failed");
+      free(line);
       exit(EXIT_FAILURE);
+    } else {
+      line = temp;
     }
-    strcpy(heap_value, value);
 
-    keyvalues_t *curr = (*head);
-    keyvalues_t *prev = NULL;
-    while (curr && curr->key <= key) {
-      if (curr->key == key) {
-        free(curr->value);
-        curr->value = heap_value;
-        return;
+    memcpy(line + linelen, buffer, chunklen + 1);
+    linelen += chunklen;
+
+    if (buffer[chunklen - 1] == '\n' || feof(db_fp)) {
+      // build database hash index
+      line[strcspn(line, "\n")] = '\0';
+      char *linecpy_p = line;
+
+      // TODO: 1. Make sure database is not corrupted
+      char *nptr = strsep(&linecpy_p, ",");
+      char *value = strsep(&linecpy_p, ",");
+      if (value) {
+        kvvalue_t v = {value, strlen(value)};
+        dbmanager(st, "p", strtoll(nptr, NULL, 10), &v, stdout);
       }
-      prev = curr;
-      curr = curr->next;
+
+      // clean up for next line
+      linelen = 0;
+      free(line);
+      line = NULL;
     }
+  } // TODO:Check ferror(db_fp)
+  fclose(db_fp);
+  return true;
+}
 
-    keyvalues_t *node = malloc(sizeof(*node));
-    if (!node) {
-      perror("malloc failed to allocated keyvalues_t node");
-      exit(EXIT_FAILURE);
+// Replay the operations logged since the last snapshot. Records are:
+//   "P,key,len\n" + len value bytes + "\n"   put
+//   "d,key\n"                               delete
+//   "c\n"                                   clear
+// and "p,key,value\n" puts written by earlier versions. A final record cut
+// short is an append torn by a crash and is ignored. Returns the length of
+// the well-formed prefix of the log.
+off_t replay_log(kvstore_t *st, const char *logname) {
+  FILE *log_fp = fopen(logname, "r");
+  if (!log_fp) {
+    return 0;
+  }
+  off_t size = file_size(logname);
+
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t nread;
+  off_t valid = 0;
+  char *payload = NULL;
+  while ((nread = getline(&line, &len, log_fp)) != -1) {
+    if (line[nread - 1] != '\n') {
+      break;
     }
-    node->key = key;
-    node->value = heap_value;
-    node->next = NULL;
+    line[nread - 1] = '\0';
 
-    if (*head == NULL || (*head)->key > node->key) {
-      node->next = *head;
-      *head = node;
-      return;
+    char *linecpy_p = line;
+    char *option = strsep(&linecpy_p, ",");
+    char *nptr = strsep(&linecpy_p, ",");
+    char *value = strsep(&linecpy_p, ",");
+
+    size_t vlen = 0;
+    if (option[0] == 'P' && nptr && value) {
+      // The value and its closing newline must be there in full.
+      vlen = strtoull(value, NULL, 10);
+      if (vlen >= (uint64_t)(size - valid - nread)) {
+        break;
+      }
+      payload = realloc(payload, vlen + 1);
+      if (!payload) {
+        perror("realloc() failed");
+        exit(EXIT_FAILURE);
+      }
+      if (fread(payload, 1, vlen + 1, log_fp) != vlen + 1 ||
+          payload[vlen] != '\n') {
+        break;
+      }
+      nread += vlen + 1;
+    }
+    valid += nread;
+
+    switch (option[0]) {
+    case 'c':
+      kvstore_clear(st);
+      break;
+    case 'd':
+      if (nptr) {
+        kvstore_del(st, strtoll(nptr, NULL, 10));
+      }
+      break;
+    case 'p':
+      if (nptr && value) {
+        kvstore_put(st, strtoll(nptr, NULL, 10), value, strlen(value));
+      }
+      break;
+    case 'P':
+      if (nptr && value) {
+        kvstore_put(st, strtoll(nptr, NULL, 10), payload, vlen);
+      }
+      break;
+    default:
+      fprintf(stderr, "Skipping corrupted log record: '%s'\n", line);
     }
-    node->next = prev->next;
-    prev->next = node;
+  }
+  free(payload);
+  free(line);
+  fclose(log_fp);
+  return valid;
+}
+
+// Make a rename(), unlink() or file creation in the database directory
+// durable.
+void fsync_dir(kvfiles_t *files) {
+  int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0 || fsync(dir_fd) != 0) {
+    perror("fsync() failed on database directory");
+    exit(EXIT_FAILURE);
+  }
+  close(dir_fd);
+  files->syncs++;
+}
+
+static void kvlog_open(kvfiles_t *files) {
+  files->log_created = access(files->logname, F_OK) != 0;
+  files->log_fp = fopen(files->logname, "a");
+  if (!files->log_fp) {
+    perror("fopen() failed to open database log");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Puts are logged length-prefixed (see replay_log()), whatever command made
+// them.
+void kvlog_append(kvfiles_t *files, char option, int64_t key,
+                  const kvvalue_t *value) {
+  pthread_mutex_lock(&files->log_lock);
+  if (!files->log_fp) {
+    kvlog_open(files);
+  }
+
+  off_t n;
+  switch (option) {
+  case 'p':
+  case 'P':
+    n = fprintf(files->log_fp, "P,%" PRId64 ",%zu\n", key, value->len);
+    if (n < 0 ||
+        fwrite(value->data, 1, value->len, files->log_fp) != value->len ||
+        fputc('\n', files->log_fp) == EOF) {
+      n = -1;
+    } else {
+      n += value->len + 1;
+    }
+    break;
+  case 'd':
+    n = fprintf(files->log_fp, "d,%" PRId64 "\n", key);
+    break;
+  default:
+    n = fprintf(files->log_fp, "c\n");
+    files->force_compact = true;
     break;
   }
+  if (n < 0) {
+    perror("Failed to append to database log");
+    exit(EXIT_FAILURE);
   }
+  files->log_bytes += n;
+  files->records++;
+  pthread_mutex_unlock(&files->log_lock);
 }
-// =============================================================================
-int main(int argc, char *argv[]) {
 
-  // TODO: Validate arguments number
+// Group commit: a single fdatasync() makes every record appended before it
+// durable, however many operations and connections that covers. A caller
+// whose records were covered by someone else's fdatasync() while it waited
+// returns at once. Nothing is acknowledged before the records behind it are
+// synced.
+void kvlog_sync(kvfiles_t *files) {
+  pthread_mutex_lock(&files->log_lock);
+  size_t upto = files->records;
+  pthread_mutex_unlock(&files->log_lock);
 
-  keyvalues_t *dbhead = NULL;
-  // ---------------------------------------------------------------------------
-  char *filename = "database.txt";
-  FILE *db_fp = fopen(filename, "r");
-  /* if (!db_fp) {
-    // This is a normal condition: fail silently
-  } else { */
-  if (db_fp) {
-    // ---------------------------------------------------------------------------
-    char buffer[BUFSIZ];
-    char *line = NULL;
-    size_t linelen = 0;
-    while (fgets(buffer, BUFSIZ, db_fp)) {
-      size_t chunklen = strlen(buffer);
-      char *temp = realloc(line, linelen + chunklen + 1);
-      if (!temp) {
-        perror("realloc() failed");
-        free(line);
-        exit(EXIT_FAILURE);
-      } else {
-        line = temp;
-      }
+  pthread_mutex_lock(&files->sync_lock);
+  if (files->synced >= upto || files->batch) {
+    pthread_mutex_unlock(&files->sync_lock);
+    return;
+  }
+  // Flush under the log lock, so exactly the records counted so far are
+  // handed to the kernel; appends go on while the fdatasync() runs.
+  pthread_mutex_lock(&files->log_lock);
+  FILE *fp = files->log_fp; // NULL: a compaction absorbed the records
+  bool created = files->log_created;
+  if (fp && fflush(fp) != 0) {
+    perror("Failed to sync database log");
+    exit(EXIT_FAILURE);
+  }
+  upto = files->records;
+  files->log_created = false;
+  pthread_mutex_unlock(&files->log_lock);
 
-      memcpy(line + linelen, buffer, chunklen + 1);
-      linelen += chunklen;
+  if (fp) {
+    if (fdatasync(fileno(fp)) != 0) {
+      perror("Failed to sync database log");
+      exit(EXIT_FAILURE);
+    }
+    files->syncs++;
+    if (created) {
+      fsync_dir(files);
+    }
+  }
+  files->synced = upto;
+  pthread_mutex_unlock(&files->sync_lock);
+}
 
-      if (buffer[chunklen - 1] == '\n' || feof(db_fp)) {
-        // build database linked list
-        line[strcspn(line, "\n")] = '\0';
-        char *linecpy_p = line;
+// Callers hold the store's write lock, so nothing is appended meanwhile.
+void kvlog_close(kvfiles_t *files) {
+  kvlog_sync(files);
+  if (files->log_fp && fclose(files->log_fp) != 0) {
+    perror("fclose() failed to write database log");
+    exit(EXIT_FAILURE);
+  }
+  files->log_fp = NULL;
+}
 
-        // TODO: 1. Make sure database is not corrupted
-        char *nptr = strsep(&linecpy_p, ",");
-        char *value = strsep(&linecpy_p, ",");
-        int key = atoi(nptr);
+void kvlog_report(const kvfiles_t *files, FILE *out) {
+  fprintf(out, "log: %zu records, %zu fsyncs (%.3f per record)\n",
+          files->records, files->syncs,
+          files->records ? (double)files->syncs / files->records : 0.0);
+}
 
-        dbmanager(&dbhead, "p", key, value);
+static void write_or_die(FILE *fp, const void *buf, size_t len) {
+  if (fwrite(buf, 1, len, fp) != len) {
+    perror("fwrite() failed to write snapshot");
+    exit(EXIT_FAILURE);
+  }
+}
 
-        // clean up for next line
-        linelen = 0;
-        free(line);
-        line = NULL;
-      }
-    } // TODO:Check ferror(db_fp)
-    fclose(db_fp);
+// Stream the visible records into a new snapshot file. Each section is
+// written by its own ordered pass, so nothing is buffered per record.
+void kvsnap_write(const kvstore_t *st, kvfiles_t *files, const char *filename) {
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    perror("fopen() failed");
+    exit(EXIT_FAILURE);
   }
 
-  // -----------------------------------------------------------------------------
-  // Parse command invocation options
-  for (size_t i = 1; i < argc; i++) {
-    char *option = strsep(&argv[i], ",");
-    char *nptr = strsep(&argv[i], ",");
-    char *value = strsep(&argv[i], ",");
-    int key;
-
-    if (nptr) {
+  kvsnap_header_t hdr = {.version = KVSNAP_VERSION};
+  memcpy(hdr.magic, KVSNAP_MAGIC, sizeof(hdr.magic));
+  hdr.keys_off = sizeof(hdr);
+  kviter_t it;
+  int64_t key;
+  kvvalue_t value;
+
+  // Pass 1: keys
+  if (fseek(fp, hdr.keys_off, SEEK_SET) != 0) {
+    perror("fseek() failed");
+    exit(EXIT_FAILURE);
+  }
+  kviter_init(&it, st, INT64_MIN);
+  while (kviter_next(&it, &key, &value)) {
+    write_or_die(fp, &key, sizeof(key));
+    hdr.count++;
+  }
+  // 8-byte keys leave the offsets aligned already.
+  hdr.offs_off = hdr.keys_off + hdr.count * sizeof(int64_t);
+
+  // Pass 2: value offsets
+  uint64_t off = 0;
+  write_or_die(fp, &off, sizeof(off));
+  kviter_init(&it, st, INT64_MIN);
+  while (kviter_next(&it, &key, &value)) {
+    off += value.len;
+    write_or_die(fp, &off, sizeof(off));
+  }
+  hdr.heap_off = hdr.offs_off + (hdr.count + 1) * sizeof(uint64_t);
+  hdr.heap_size = off;
+
+  // Pass 3: value heap
+  kviter_init(&it, st, INT64_MIN);
+  while (kviter_next(&it, &key, &value)) {
+    write_or_die(fp, value.data, value.len);
+  }
+
+  rewind(fp);
+  write_or_die(fp, &hdr, sizeof(hdr));
+  // The data has to be on disk before rename() can publish it.
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0) {
+    perror("Failed to write snapshot");
+    unlink(filename);
+    exit(EXIT_FAILURE);
+  }
+  files->syncs++;
+}
+
+// Write every record to a fresh snapshot, swap it in with rename() and drop
+// the log (and legacy file) it absorbed. The rename is synced before the log
+// goes: a crash can at worst leave the old log next to the new snapshot, and
+// replaying it there yields the same state.
+// The store is reopened on the new snapshot with an empty index.
+void compact(kvstore_t *st, kvfiles_t *files) {
+  char tmpname[PATH_MAX];
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", files->snapname);
+
+  kvlog_close(files);
+  kvsnap_write(st, files, tmpname);
+  if (rename(tmpname, files->snapname) != 0) {
+    perror("rename() failed to install snapshot");
+    unlink(tmpname);
+    exit(EXIT_FAILURE);
+  }
+  fsync_dir(files);
+  unlink(files->logname);
+  unlink(files->legacyname);
+  files->log_bytes = 0;
+  files->force_compact = false;
+
+  kvstore_clear(st);
+  kvsnap_open(&st->snap, files->snapname);
+  st->live = st->snap.count;
+}
+
+bool should_compact(const kvstore_t *st, const kvfiles_t *files) {
+  if (files->force_compact) {
+    return true;
+  }
+  return files->log_bytes >= KV_COMPACT_MIN_BYTES &&
+         (size_t)files->log_bytes > st->snap.size;
+}
+// =============================================================================
+// Parse and run one command of arglen bytes at arg:
+//   option[,key[,value]]   the value is everything after the second comma
+//   P,key,len\n<value>     a put framed by its length, the value may be binary
+// Results go to out and complaints about the command itself to err.
+void run_command(kvstore_t *st, kvfiles_t *files, char *arg, size_t arglen,
+                 size_t argno, FILE *out, FILE *err) {
+  char *end = arg + arglen;
+  char *framed = arg[0] == 'P' ? memchr(arg, '\n', arglen) : NULL;
+  if (framed) {
+    *framed++ = '\0';
+  }
+  char *option = strsep(&arg, ",");
+  char *nptr = strsep(&arg, ",");
+  char *value = framed ? framed : arg;
+  size_t vlen = value ? (size_t)(end - value) : 0;
+  int64_t key = 0;
+
+  if (nptr) {
+    char *endptr = NULL;
+    errno = 0;
+    key = strtoll(nptr, &endptr, 10);
+    // Check for various error conditions.
+    // 1. Check for overflow/underflow (errno is set).
+    if (errno == ERANGE) {
+      fprintf(err, "Range error at argument %lu: %s\n", argno,
+              strerror(errno));
+      return;
+    }
+    // 2. Check if no digits were found.
+    // no conversion: endptr will point to the beginning of nptr
+    if (endptr == nptr) {
+      fprintf(err, "Invalid key at argument %lu: '%s'\n", argno, nptr);
+      return;
+    }
+    // 3. Check for leftover characters: Not necessarily an error:
+    // endptr is not at nptr's end: nptr is not a pure number
+    if (*endptr != '\0') {
+      fprintf(err, "Trailing character(s) at arugment %lu: '%s'\n", argno,
+              nptr);
+      return;
+    }
+  }
+
+  if (!strlen(option)) {
+    fprintf(err, "Missing opiton at argument %lu: %s\n", argno, option);
+    return;
+  }
+  // Every command but 'a', 'c' and 's' needs a key; never log a garbage one.
+  if (!nptr && strchr("dgprGP", option[0])) {
+    fprintf(err, "Missing key at argument %lu\n", argno);
+    return;
+  }
+  char *valid_opts = "acdgprsGP";
+  if (strlen(option) == 1 && strchr(valid_opts, option[0])) {
+    if ((!strcmp(option, "p") && !value) || (!strcmp(option, "P") && !framed)) {
+      fprintf(err, "Missing value at argument %lu\n", argno);
+      return;
+    }
+    if (framed) {
+      // The length after the key has to match the bytes that came with it.
       char *endptr = NULL;
       errno = 0;
-      key = (int)strtol(nptr, &endptr, 10);
-      // Check for various error conditions.
-      // 1. Check for overflow/underflow (errno is set).
-      if (errno == ERANGE) {
-        fprintf(stderr, "Range error at argument %lu: %s\n", i,
-                strerror(errno));
-        continue;
+      unsigned long long len = arg ? strtoull(arg, &endptr, 10) : 0;
+      if (!arg || errno == ERANGE || endptr == arg || *endptr != '\0' ||
+          len != vlen) {
+        fprintf(err, "Bad value length at argument %lu\n", argno);
+        return;
       }
-      // 2. Check if no digits were found.
-      // no conversion: endptr will point to the beginning of nptr
-      if (endptr == nptr) {
-        fprintf(stderr, "Invalid key at argument %lu: '%s'\n", i, nptr);
-        continue;
+    }
+    if (!strcmp(option, "r") && value) {
+      char *endptr = NULL;
+      errno = 0;
+      strtoll(value, &endptr, 10);
+      if (errno == ERANGE || endptr == value || *endptr != '\0') {
+        fprintf(err, "Invalid range end at argument %lu: '%s'\n", argno,
+                value);
+        return;
       }
-      // 3. Check for leftover characters: Not necessarily an error:
-      // endptr is not at nptr's end: nptr is not a pure number
-      if (*endptr != '\0') {
-        fprintf(stderr, "Trailing character(s) at arugment %lu: '%s'\n", i,
-                nptr);
-        continue;
+    }
+    kvvalue_t v = {value, vlen};
+    if (strchr("cdpP", option[0])) {
+      kvlock_wrlock(&st->lock);
+      dbmanager(st, option, key, value ? &v : NULL, out);
+      kvlog_append(files, option[0], key, &v);
+      kvlock_wrunlock(&st->lock);
+    } else {
+      kvlock_rdlock(&st->lock);
+      dbmanager(st, option, key, value ? &v : NULL, out);
+      if (option[0] == 's') {
+        kvlog_report(files, out);
+      }
+      kvlock_rdunlock(&st->lock);
+    }
+  } else {
+    fprintf(err, "Bad opiton at argument %lu: %s\n", argno, option);
+  }
+}
+
+#ifndef KV_VALUE_MAX
+#define KV_VALUE_MAX (1ULL << 30) // largest framed value a stream may send
+#endif /* ifndef KV_VALUE_MAX */
+
+// Read one command from a stream: a line, or for a framed put the
+// "P,key,len" line together with the len value bytes and the newline after
+// them. Either way the command is left in *line without its final newline.
+// Returns its length, or -1 at the end of the stream.
+ssize_t read_command(FILE *in, char **line, size_t *cap) {
+  ssize_t nread = getline(line, cap, in);
+  if (nread == -1) {
+    return -1;
+  }
+  if ((*line)[nread - 1] == '\n') {
+    (*line)[--nread] = '\0';
+  }
+
+  char *lenstr = strrchr(*line, ',');
+  if ((*line)[0] != 'P' || !lenstr || lenstr == *line + 1) {
+    return nread;
+  }
+  char *endptr = NULL;
+  errno = 0;
+  unsigned long long len = strtoull(lenstr + 1, &endptr, 10);
+  if (errno == ERANGE || endptr == lenstr + 1 || *endptr != '\0') {
+    return nread; // run_command() will complain
+  }
+
+  char *buf = len <= KV_VALUE_MAX ? realloc(*line, nread + len + 2) : NULL;
+  if (!buf) {
+    fprintf(stderr, "No room for a %llu byte value\n", len);
+    return -1;
+  }
+  *line = buf;
+  *cap = nread + len + 2;
+  buf[nread] = '\n';
+  if (fread(buf + nread + 1, 1, len + 1, in) != len + 1 ||
+      buf[nread + 1 + len] != '\n') {
+    buf[nread] = '\0';
+    fprintf(stderr, "Bad or truncated value for '%s'\n", buf);
+    return -1;
+  }
+  buf[nread + 1 + len] = '\0';
+  return nread + 1 + len;
+}
+// =============================================================================
+// Batch mode: stream commands, one per line, from a file or stdin. The log
+// records of the whole batch are collected in memory and persisted once at
+// the end: appended with a single write, or absorbed by the compaction the
+// batch has made necessary.
+// =============================================================================
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run_batch(kvstore_t *st, kvfiles_t *files, const char *filename,
+               bool report) {
+  FILE *in = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+  if (!in) {
+    perror("fopen() failed to open command file");
+    exit(EXIT_FAILURE);
+  }
+
+  kvlog_close(files);
+  files->log_fp = open_memstream(&files->batch_buf, &files->batch_len);
+  if (!files->log_fp) {
+    perror("open_memstream() failed");
+    exit(EXIT_FAILURE);
+  }
+  files->batch = true;
+
+  double start = now_seconds();
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t nread;
+  size_t ops = 0, bytes = 0;
+  while ((nread = read_command(in, &line, &len)) != -1) {
+    bytes += nread + 1;
+    if (nread) {
+      run_command(st, files, line, nread, ++ops, stdout, stderr);
+    }
+  }
+  if (ferror(in)) {
+    perror("Failed to read command file");
+    exit(EXIT_FAILURE);
+  }
+  free(line);
+  if (in != stdin) {
+    fclose(in);
+  }
+  double elapsed = now_seconds() - start;
+
+  if (report) {
+    fprintf(stderr, "%zu ops, %zu bytes in %.3f s: %.0f ops/sec, %.0f bytes/sec\n",
+            ops, bytes, elapsed, elapsed > 0 ? ops / elapsed : 0.0,
+            elapsed > 0 ? bytes / elapsed : 0.0);
+  }
+}
+
+// Persist the records a batch collected, unless the compaction (or the
+// unlinking of an emptied database) about to happen covers them anyway.
+void kvlog_end_batch(kvstore_t *st, kvfiles_t *files) {
+  if (!files->batch) {
+    return;
+  }
+  if (fclose(files->log_fp) != 0) {
+    perror("fclose() failed on batch log buffer");
+    exit(EXIT_FAILURE);
+  }
+  files->log_fp = NULL;
+  files->batch = false;
+
+  if (files->batch_len && st->live && !should_compact(st, files)) {
+    kvlog_open(files);
+    if (fwrite(files->batch_buf, 1, files->batch_len, files->log_fp) !=
+        files->batch_len) {
+      perror("Failed to append batch to database log");
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(files->batch_buf);
+  files->batch_buf = NULL;
+  files->batch_len = 0;
+}
+// =============================================================================
+// Server mode: keep the store resident and take the same command grammar over
+// a Unix domain socket, one command per line. A connection is answered once
+// the client has shut down its write side and every command has run.
+// A pool of worker threads serves connections concurrently: lookups run in
+// parallel under the store's striped lock, changes one at a time. A worker
+// takes the connections queued up behind the one it woke for as a group,
+// and all the groups in flight share log fsyncs (see kvlog_sync()) before
+// any of their replies go out. Since a group's connections are read one
+// after another, a client that goes quiet without shutting down is cut off
+// after KV_CLIENT_TIMEOUT_MS, so it holds up the others only that long.
+// =============================================================================
+#define KV_GROUP_MAX 64
+#define KV_THREADS_MAX 256
+#define KV_CLIENT_TIMEOUT_MS 1000 // longest wait for a client's next bytes
+
+typedef struct {
+  int fd;
+  char *reply;
+  size_t len;
+} kvpending_t;
+
+typedef struct {
+  kvstore_t *st;
+  kvfiles_t *files;
+  int listen_fd;
+  int stop_fd; // readable once the server is shutting down
+} kvserver_t;
+
+// Run the commands of one connection, holding the replies back in memory.
+// A read that times out ends the connection; a command it cut short is not
+// run.
+void serve_client(kvstore_t *st, kvfiles_t *files, kvpending_t *conn) {
+  int in_fd = dup(conn->fd);
+  FILE *in = in_fd < 0 ? NULL : fdopen(in_fd, "r");
+  FILE *out = open_memstream(&conn->reply, &conn->len);
+  if (!in || !out) {
+    perror("Failed to set up client connection");
+    exit(EXIT_FAILURE);
+  }
+
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t nread;
+  size_t lineno = 0;
+  while ((nread = read_command(in, &line, &len)) != -1 && !ferror(in)) {
+    lineno++;
+    if (nread) {
+      run_command(st, files, line, nread, lineno, out, out);
+    }
+  }
+  if (ferror(in)) {
+    fprintf(out, "Error: Timed out or failed reading command %zu\n", lineno + 1);
+  }
+  free(line);
+  fclose(in);
+  fclose(out);
+}
+
+// Send a held-back reply and hang up. A client that went away is not our
+// problem.
+void finish_client(kvpending_t *conn) {
+  for (size_t off = 0; off < conn->len;) {
+    ssize_t n = write(conn->fd, conn->reply + off, conn->len - off);
+    if (n <= 0) {
+      break;
+    }
+    off += n;
+  }
+  free(conn->reply);
+  close(conn->fd);
+}
+
+static void *serve_worker(void *arg) {
+  kvserver_t *srv = arg;
+  kvstore_t *st = srv->st;
+  kvfiles_t *files = srv->files;
+  kvpending_t group[KV_GROUP_MAX];
+
+  for (;;) {
+    struct pollfd pfd[2] = {{.fd = srv->listen_fd, .events = POLLIN},
+                            {.fd = srv->stop_fd, .events = POLLIN}};
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno != EINTR) {
+        perror("poll() failed");
       }
+      continue;
+    }
+    if (pfd[1].revents) {
+      break;
     }
 
-    if (!strlen(option)) {
-      fprintf(stderr, "Missing opiton at argument %lu: %s\n", i, option);
+    // Several workers wake for one connection; the losers get EAGAIN.
+    size_t n = 0;
+    while (n < KV_GROUP_MAX) {
+      int conn_fd = accept(srv->listen_fd, NULL, NULL);
+      if (conn_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          perror("accept() failed");
+        }
+        break;
+      }
+      struct timeval timeout = {.tv_sec = KV_CLIENT_TIMEOUT_MS / 1000,
+                                .tv_usec = KV_CLIENT_TIMEOUT_MS % 1000 * 1000};
+      setsockopt(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      group[n].fd = conn_fd;
+      serve_client(st, files, &group[n++]);
+    }
+    if (!n) {
       continue;
     }
-    char *valid_opts = "acdgp";
-    if (strstr(valid_opts, option)) {
-      if (!strcmp(option, "p") && !value) {
-        fprintf(stderr, "Missing value at argument %lu\n", i);
-        continue;
+
+    kvlog_sync(files);
+    for (size_t i = 0; i < n; i++) {
+      finish_client(&group[i]);
+    }
+
+    // Only block the readers when there is compacting to do.
+    kvlock_rdlock(&st->lock);
+    bool due = should_compact(st, files);
+    kvlock_rdunlock(&st->lock);
+    if (due) {
+      kvlock_wrlock(&st->lock);
+      if (should_compact(st, files)) {
+        compact(st, files);
       }
-      dbmanager(&dbhead, option, key, value);
-    } else {
-      fprintf(stderr, "Bad opiton at argument %lu: %s\n", i, option);
+      kvlock_wrunlock(&st->lock);
     }
   }
+  return NULL;
+}
 
-  // FIX: Bad idea to truncate whole database before updating it
-  db_fp = fopen(filename, "w");
-  if (!db_fp) {
-    perror("fopen() failed");
+void serve(kvstore_t *st, kvfiles_t *files, const char *sockpath,
+           int nthreads) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: '%s'\n", sockpath);
     exit(EXIT_FAILURE);
   }
-  // Update database disk file
-  for (keyvalues_t *curr = dbhead; curr; curr = curr->next) {
-    fprintf(db_fp, "%d,%s\n", curr->key, curr->value);
+  strcpy(addr.sun_path, sockpath);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket() failed");
+    exit(EXIT_FAILURE);
+  }
+  // A socket file nobody answers on is left over from a dead server.
+  if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "A kv server is already listening on '%s'\n", sockpath);
+    exit(EXIT_FAILURE);
   }
+  unlink(sockpath);
+  close(listen_fd);
 
-  // After an attemp to update the disk file if the db head is null
-  // delete the database disk file.
-  if (!dbhead) {
-    // printf("unlink()\n");
-    unlink(filename);
+  // Non-blocking, so the queue can be drained without waiting on it; the
+  // accepted connections themselves stay blocking.
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 128) != 0) {
+    perror("Failed to listen on kv socket");
+    exit(EXIT_FAILURE);
   }
 
-  // Free memory dynamallocated to database linked list
-  for (keyvalues_t *curr = dbhead; curr; curr = dbhead) {
-    dbhead = curr->next;
-    free(curr->value);
-    free(curr);
+  // The workers inherit a mask blocking SIGINT and SIGTERM; only the main
+  // thread takes them, in sigwait().
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int stop_pipe[2];
+  if (pipe(stop_pipe) != 0) {
+    perror("pipe() failed");
+    exit(EXIT_FAILURE);
+  }
+  kvserver_t srv = {st, files, listen_fd, stop_pipe[0]};
+  pthread_t workers[KV_THREADS_MAX];
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&workers[i], NULL, serve_worker, &srv) != 0) {
+      perror("pthread_create() failed");
+      exit(EXIT_FAILURE);
+    }
   }
 
-  // Close database stream file
-  fclose(db_fp);
+  int sig;
+  sigwait(&stop_signals, &sig);
+  // Never read, so it wakes every worker's poll() for good.
+  if (write(stop_pipe[1], "", 1) != 1) {
+    perror("write() failed to stop workers");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  close(stop_pipe[0]);
+  close(stop_pipe[1]);
+  close(listen_fd);
+  unlink(sockpath);
+}
+// =============================================================================
+int main(int argc, char *argv[]) {
+
+  // TODO: Validate arguments number
+
+  kvstore_t st = {0};
+  kvlock_init(&st.lock);
+  kvfiles_t files = {
+      .snapname = "database.snap",
+      .legacyname = "database.txt",
+      .logname = "database.log",
+      .log_lock = PTHREAD_MUTEX_INITIALIZER,
+      .sync_lock = PTHREAD_MUTEX_INITIALIZER,
+  };
+  files.log_bytes = file_size(files.logname);
+
+  if (kvsnap_open(&st.snap, files.snapname)) {
+    st.live = st.snap.count;
+  } else if (load_legacy(&st, files.legacyname)) {
+    files.force_compact = true;
+  }
+  off_t valid = replay_log(&st, files.logname);
+  if (valid < files.log_bytes) {
+    // Cut off a torn tail so new records do not get glued onto it.
+    if (truncate(files.logname, valid) != 0) {
+      perror("truncate() failed to repair database log");
+      exit(EXIT_FAILURE);
+    }
+    files.log_bytes = valid;
+  }
+
+  // -----------------------------------------------------------------------------
+  bool report = false;
+  if (argc > 1 && !strcmp(argv[1], "--serve")) {
+    // ./kv --serve [-j <threads>] [socket]
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+    optind = 2;
+    while ((c = getopt(argc, argv, "+j:")) != -1) {
+      switch (c) {
+      case 'j':
+        nthreads = strtol(optarg, NULL, 10);
+        if (nthreads < 1 || nthreads > KV_THREADS_MAX) {
+          fprintf(stderr, "Thread count must be 1 to %d\n", KV_THREADS_MAX);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: kv --serve [-j threads] [socket]\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (nthreads < 1 || nthreads > KV_THREADS_MAX) {
+      nthreads = nthreads < 1 ? 1 : KV_THREADS_MAX;
+    }
+    const char *sockpath = optind < argc ? argv[optind] : getenv(KV_SOCKET_ENV);
+    serve(&st, &files, sockpath ? sockpath : KV_SOCKET_DEFAULT, nthreads);
+  } else {
+    // ./kv [-f <file|->] [-t] [command...]
+    // '+': stop at the first command, a key like "d,-1" is not an option.
+    const char *batchfile = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "+f:t")) != -1) {
+      switch (c) {
+      case 'f':
+        batchfile = optarg;
+        break;
+      case 't':
+        report = true;
+        break;
+      default:
+        fprintf(stderr, "usage: kv [-f file|-] [-t] [command...]\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (batchfile) {
+      run_batch(&st, &files, batchfile, report);
+    }
+    // Parse command invocation options
+    for (size_t i = optind; i < argc; i++) {
+      run_command(&st, &files, argv[i], strlen(argv[i]), i, stdout, stderr);
+    }
+    kvlog_end_batch(&st, &files);
+  }
+
+  kvlog_close(&files);
+
+  // An empty database leaves no files behind. Otherwise a read-only run
+  // writes nothing, and a run that changed data has already appended to the
+  // log; only fold the log into the snapshot once it has grown too big.
+  if (!st.live) {
+    unlink(files.snapname);
+    unlink(files.logname);
+    unlink(files.legacyname);
+  } else if (should_compact(&st, &files)) {
+    compact(&st, &files);
+  }
+  if (report) {
+    kvlog_report(&files, stderr);
+  }
+
+  // Free memory dynamallocated to database hash index and unmap the snapshot
+  kvstore_clear(&st);
   return EXIT_SUCCESS;
 }
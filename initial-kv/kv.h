@@ -0,0 +1,14 @@
+/* ostep-projects/initial-kv/kv.h */
+// Shared between the kv store and its thin client kvc.
+#ifndef KV_H
+#define KV_H
+
+// Where 'kv --serve' listens and kvc connects, unless $KV_SOCKET says
+// otherwise. The protocol is the command-line grammar, one command per line,
+// plus "P,key,len\n" followed by len raw value bytes and a newline for values
+// a line cannot carry. The server replies once the client has shut down its
+// write side.
+#define KV_SOCKET_ENV "KV_SOCKET"
+#define KV_SOCKET_DEFAULT "kv.sock"
+
+#endif /* ifndef KV_H */
@@ -0,0 +1,159 @@
+/* ostep-projects/initial-kv/kvc.c */
+// Thin client for 'kv --serve': sends every argument as one command and
+// prints the server's replies. Takes the same arguments as kv itself:
+// prompt> ./kvc p,10,remzi g,10
+// As a load generator, -c clients threads each send the commands over -n
+// connections, one after another; replies are dropped and the throughput is
+// reported on stderr:
+// prompt> ./kvc -c 4 -n 1000 g,10 g,20
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+static struct sockaddr_un addr = {.sun_family = AF_UNIX};
+static char **commands;
+static int ncommands;
+static long rounds = 1;
+
+// Send the commands over one connection and copy the replies to stdout,
+// unless quiet.
+static void run_once(bool quiet) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket() failed");
+    exit(EXIT_FAILURE);
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Could not reach a kv server on '%s'\n", addr.sun_path);
+    exit(EXIT_FAILURE);
+  }
+
+  // Batch every command into one buffered write.
+  FILE *out = fdopen(dup(fd), "w");
+  if (!out) {
+    perror("fdopen() failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < ncommands; i++) {
+    char *cmd = commands[i];
+    // A newline would split the argument into two commands: send a put of
+    // such a value framed by its length instead.
+    if (strchr(cmd, '\n')) {
+      char *value = cmd[0] == 'p' ? strchr(cmd, ',') : NULL;
+      value = value ? strchr(value + 1, ',') : NULL;
+      if (!value || memchr(cmd, '\n', value - cmd)) {
+        fprintf(stderr, "Newline in argument %d skipped\n", i + 1);
+        continue;
+      }
+      value++;
+      fprintf(out, "P%.*s,%zu\n%s\n", (int)(value - cmd - 2), cmd + 1,
+              strlen(value), value);
+      continue;
+    }
+    fprintf(out, "%s\n", cmd);
+  }
+  if (fclose(out) != 0) {
+    perror("Failed to send commands");
+    exit(EXIT_FAILURE);
+  }
+  shutdown(fd, SHUT_WR);
+
+  char buf[BUFSIZ];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    if (!quiet) {
+      fwrite(buf, 1, n, stdout);
+    }
+  }
+  if (n < 0) {
+    perror("read() failed");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+static void *run_client(void *arg) {
+  (void)arg;
+  for (long i = 0; i < rounds; i++) {
+    run_once(true);
+  }
+  return NULL;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  const char *sockpath = getenv(KV_SOCKET_ENV);
+  if (!sockpath) {
+    sockpath = KV_SOCKET_DEFAULT;
+  }
+  if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: '%s'\n", sockpath);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, sockpath);
+
+  // '+': stop at the first command, a key like "d,-1" is not an option.
+  long clients = 0;
+  int c;
+  while ((c = getopt(argc, argv, "+c:n:")) != -1) {
+    switch (c) {
+    case 'c':
+      clients = strtol(optarg, NULL, 10);
+      break;
+    case 'n':
+      rounds = strtol(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr, "usage: kvc [-c clients -n rounds] [command...]\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  commands = argv + optind;
+  ncommands = argc - optind;
+
+  if (!clients) {
+    run_once(false);
+    return EXIT_SUCCESS;
+  }
+
+  if (clients < 1 || rounds < 1) {
+    fprintf(stderr, "Client and round counts must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_t *threads = malloc(clients * sizeof(*threads));
+  if (!threads) {
+    perror("malloc() failed");
+    exit(EXIT_FAILURE);
+  }
+  double start = now_seconds();
+  for (long i = 0; i < clients; i++) {
+    if (pthread_create(&threads[i], NULL, run_client, NULL) != 0) {
+      perror("pthread_create() failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (long i = 0; i < clients; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now_seconds() - start;
+  free(threads);
+
+  double ops = (double)clients * rounds * ncommands;
+  fprintf(stderr, "%ld clients, %.0f ops in %.3f s: %.0f ops/sec\n", clients,
+          ops, elapsed, elapsed > 0 ? ops / elapsed : 0.0);
+  return EXIT_SUCCESS;
+}
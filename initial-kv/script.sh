@@ -8,10 +8,17 @@ DB_PROGRAM="kv-v1.out"
 DB_SOURCE="kv-v1.c"
 DB_FILE="database.txt"
 VALGRIND_LOG="valgrind-log.txt"
+KV_PROGRAM="kv"
+KV_CLIENT="kvc"
+KV_SOCKET="kv.sock"
+KV_FILES=("database.txt" "database.snap" "database.log")
 # WORDLIST="/usr/share/dict/words"
 WORDLIST="/usr/share/dict/spanish"
 readonly MIN_KEY=0
 readonly MAX_KEY=9999
+# The linked-list baseline is quadratic on load: cap its run so the
+# benchmark finishes in seconds rather than hours.
+readonly BENCH_BASELINE_MAX=20000
 
 
 # --- Utility Functions ---
@@ -45,10 +52,15 @@ _usage() {
 
 	Usage: ./${0##*/} {seed|val|test|clean}
 
-	seed <count>: Populate the database with random entries.
-	val <count>:  Runs a memory leak check and saves output to a log file.
-	test:         Run some tests.
-	clean:        Removes compiled executable and generated files.
+	seed <count>:  Populate the database with random entries.
+	val <count>:   Runs a memory leak check and saves output to a log file.
+	test:          Run some tests.
+	bench [count]: Time loading <count> keys (default 1000000) into
+	               '$KV_PROGRAM' (hash index) and '$DB_PROGRAM' (sorted list),
+	               then the cost of one 'g' against a store that size, one
+	               shot and through '$KV_CLIENT' against 'kv --serve', and
+	               of a 100-key 'r' scan against filtering 'a'.
+	clean:         Removes compiled executable and generated files.
 
 	EOF
 }
@@ -257,6 +269,264 @@ _run_tests() {
 	echo "All tests passed successfully!"
 }
 
+# ==  Benchmark helper functions  ==============================================
+# Current time in nanoseconds.
+_now_ns() {
+	command date +%s%N
+}
+
+# Write <count> sequential "key,value" lines to the database file. Sorted
+# input is the worst case for the sorted linked list.
+_seed_sequential() {
+	local count="$1"
+	command awk -v n="$count" 'BEGIN { for (i = 0; i < n; i++) printf "%d,value%d\n", i, i }' > "$DB_FILE"
+}
+
+# Time one invocation of <program> that loads <count> keys from the database
+# file and does a single get, then print ops/sec. For kv this includes
+# writing the binary snapshot the text file is imported into.
+_bench_load_one() {
+	local program="$1"
+	local count="$2"
+	local start end elapsed_ns
+
+	_seed_sequential "$count"
+	start=$(_now_ns)
+	./"$program" g,0 > /dev/null
+	end=$(_now_ns)
+	elapsed_ns=$((end - start))
+	rm -f "${KV_FILES[@]}"
+
+	command awk -v p="$program" -v n="$count" -v ns="$elapsed_ns" 'BEGIN {
+		s = ns / 1e9
+		printf "%-12s %10d keys %10.3f s %14.0f ops/sec\n", p, n, s, (s > 0 ? n / s : 0)
+	}'
+}
+
+# Stream <count> puts into kv through its batch mode and let it report the
+# throughput itself.
+_bench_batch() {
+	local count="$1"
+	local report
+
+	command awk -v n="$count" 'BEGIN { for (i = 0; i < n; i++) printf "p,%d,value%d\n", i, i }' |
+		./"$KV_PROGRAM" -t -f - 2> batch-report.txt
+	report=$(cat batch-report.txt)
+	rm -f batch-report.txt "${KV_FILES[@]}"
+	printf "%-12s %s\n" "$KV_PROGRAM -f" "$report"
+}
+
+# Average wall time in milliseconds of <runs> invocations of a command.
+_time_runs() {
+	local runs="$1"
+	shift
+	local start end
+
+	start=$(_now_ns)
+	for ((i = 0; i < runs; i++)); do
+		"$@" > /dev/null
+	done
+	end=$(_now_ns)
+	command awk -v ns="$((end - start))" -v r="$runs" 'BEGIN { printf "%.3f", ns / r / 1e6 }'
+}
+
+# Time a single get against a <count>-key store: kv maps its binary snapshot,
+# the baseline re-parses the whole text file.
+_bench_startup_one() {
+	local program="$1"
+	local count="$2"
+	local ms
+
+	_seed_sequential "$count"
+	# The first kv run imports the text file into a snapshot.
+	./"$program" g,0 > /dev/null
+	ms=$(_time_runs 20 ./"$program" "g,$((count / 2))")
+	rm -f "${KV_FILES[@]}"
+	printf "%-12s %10d keys %10s ms per 'g'\n" "$program" "$count" "$ms"
+}
+
+# Post-filter a full dump to the keys in [lo, hi), the way reports did
+# before 'r' existed.
+_scan_with_all() {
+	./"$KV_PROGRAM" a | command awk -F, -v lo="$1" -v hi="$2" '$1 >= lo && $1 < hi'
+}
+
+# Time a 100-key range query against a <count>-key store: 'r' seeks straight
+# to the range, 'a' + awk dumps and filters everything.
+_bench_range() {
+	local count="$1"
+	local lo=$((count / 2))
+	local hi=$((lo + 100))
+	local ms
+
+	_seed_sequential "$count"
+	./"$KV_PROGRAM" g,0 > /dev/null
+	ms=$(_time_runs 20 ./"$KV_PROGRAM" "r,$lo,$hi")
+	printf "%-12s %10d keys %10s ms per scan\n" "r,lo,hi" "$count" "$ms"
+	ms=$(_time_runs 5 _scan_with_all "$lo" "$hi")
+	printf "%-12s %10d keys %10s ms per scan\n" "a + awk" "$count" "$ms"
+	rm -f "${KV_FILES[@]}"
+}
+
+# Time single-key gets against a <count>-key store, first one 'kv' process per
+# request, then through the thin client against a resident 'kv --serve'. The
+# store also carries a log of updates not yet compacted, which every one-shot
+# run has to replay.
+_bench_serve() {
+	local count="$1"
+	local runs=200
+	local key=$((count / 2))
+	local server_pid ms
+
+	_seed_sequential "$count"
+	./"$KV_PROGRAM" g,0 > /dev/null
+	command awk -v n="$((count / 4))" 'BEGIN { for (i = 0; i < n; i++) printf "p,%d,update%d\n", i, i }' > database.log
+
+	ms=$(_time_runs "$runs" ./"$KV_PROGRAM" "g,$key")
+	printf "%-12s %10d keys %10s ms per 'g'\n" "$KV_PROGRAM" "$count" "$ms"
+
+	./"$KV_PROGRAM" --serve "$KV_SOCKET" &
+	server_pid=$!
+	while [[ ! -S "$KV_SOCKET" ]]; do
+		sleep 0.05
+	done
+	ms=$(KV_SOCKET="$KV_SOCKET" _time_runs "$runs" ./"$KV_CLIENT" "g,$key")
+	printf "%-12s %10d keys %10s ms per 'g'\n" "$KV_CLIENT" "$count" "$ms"
+	kill "$server_pid"
+	wait "$server_pid"
+	rm -f "${KV_FILES[@]}"
+}
+
+# Print one line of the durability benchmark from a wall time in ns.
+_print_fsync_line() {
+	command awk -v p="$1" -v n="$2" -v f="$3" -v ns="$4" 'BEGIN {
+		s = ns / 1e9
+		printf "%-12s %6d ops %6d fsyncs %8.3f fsyncs/op %10.0f ops/sec\n", p, n, f, f / n, (s > 0 ? n / s : 0)
+	}'
+}
+
+# Sum the fsyncs out of 'log: N records, M fsyncs' report lines.
+_sum_fsyncs() {
+	command awk '$1 == "log:" { f += $4 } END { print f + 0 }' "$@"
+}
+
+# Make <ops> durable puts three ways and count the fsyncs each one pays: one
+# 'kv' process per put, one batch carrying all of them, and concurrent
+# clients of a resident server whose queued requests share a group commit.
+_bench_fsync() {
+	local ops="$1"
+	local start end server_pid fsyncs
+
+	rm -f "${KV_FILES[@]}" fsync-report.txt
+	start=$(_now_ns)
+	for ((i = 0; i < ops; i++)); do
+		./"$KV_PROGRAM" -t "p,$i,value$i" 2>> fsync-report.txt
+	done
+	end=$(_now_ns)
+	_print_fsync_line "one-shot" "$ops" "$(_sum_fsyncs fsync-report.txt)" "$((end - start))"
+
+	rm -f "${KV_FILES[@]}" fsync-report.txt
+	start=$(_now_ns)
+	command awk -v n="$ops" 'BEGIN { for (i = 0; i < n; i++) printf "p,%d,value%d\n", i, i }' |
+		./"$KV_PROGRAM" -t -f - 2> fsync-report.txt
+	end=$(_now_ns)
+	_print_fsync_line "$KV_PROGRAM -f" "$ops" "$(_sum_fsyncs fsync-report.txt)" "$((end - start))"
+
+	rm -f "${KV_FILES[@]}" fsync-report.txt
+	./"$KV_PROGRAM" --serve "$KV_SOCKET" &
+	server_pid=$!
+	while [[ ! -S "$KV_SOCKET" ]]; do
+		sleep 0.05
+	done
+	start=$(_now_ns)
+	for ((i = 0; i < ops; i++)); do
+		KV_SOCKET="$KV_SOCKET" ./"$KV_CLIENT" "p,$i,value$i" > /dev/null &
+	done
+	wait $(jobs -p | command grep -vx "$server_pid")
+	end=$(_now_ns)
+	fsyncs=$(KV_SOCKET="$KV_SOCKET" ./"$KV_CLIENT" s | _sum_fsyncs)
+	_print_fsync_line "$KV_CLIENT" "$ops" "$fsyncs" "$((end - start))"
+	kill "$server_pid"
+	wait "$server_pid"
+	rm -f "${KV_FILES[@]}" fsync-report.txt
+}
+
+# Drive a resident server holding <count> keys with a 95% 'g', 5% 'p' mix
+# from 1 up to N concurrent clients, N being the number of cores (at least
+# 4), the server running a worker thread per core.
+_bench_readers() {
+	local count="$1"
+	local max server_pid report cmds
+
+	max=$(nproc)
+	if (( max < 4 )); then
+		max=4
+	fi
+	_seed_sequential "$count"
+	./"$KV_PROGRAM" g,0 > /dev/null
+	# 19 gets and one put per connection
+	cmds=$(command awk -v n="$count" 'BEGIN {
+		srand(1)
+		for (i = 0; i < 19; i++) printf "g,%d ", int(rand() * n)
+		printf "p,%d,updated\n", int(rand() * n)
+	}')
+
+	./"$KV_PROGRAM" --serve "$KV_SOCKET" &
+	server_pid=$!
+	while [[ ! -S "$KV_SOCKET" ]]; do
+		sleep 0.05
+	done
+	for ((clients = 1; clients <= max; clients *= 2)); do
+		# shellcheck disable=SC2086
+		report=$(KV_SOCKET="$KV_SOCKET" ./"$KV_CLIENT" -c "$clients" -n 500 $cmds 2>&1)
+		printf "%-12s %s\n" "$KV_CLIENT -c" "$report"
+	done
+	kill "$server_pid"
+	wait "$server_pid"
+	rm -f "${KV_FILES[@]}"
+}
+
+# Compare load throughput of the hash index against the linked-list baseline.
+_run_bench() {
+	local count="${1:-1000000}"
+	local base_count=$count
+
+	if ! [[ "$count" =~ ^[0-9]+$ ]] || (( count == 0 )); then
+		command echo "Error: The argument '$count' is not a valid number." >&2
+		return 1
+	fi
+	if (( base_count > BENCH_BASELINE_MAX )); then
+		base_count=$BENCH_BASELINE_MAX
+	fi
+
+	command make "$KV_PROGRAM" "$KV_CLIENT" "$DB_PROGRAM" > /dev/null || exit 1
+	rm -f "${KV_FILES[@]}"
+
+	_print_header "Load benchmark (before: sorted list, after: hash index)"
+	_bench_load_one "$DB_PROGRAM" "$base_count"
+	_bench_load_one "$KV_PROGRAM" "$base_count"
+	if (( count != base_count )); then
+		_bench_load_one "$KV_PROGRAM" "$count"
+	fi
+	_bench_batch "$count"
+
+	_print_header "Startup benchmark (single 'g' per invocation)"
+	_bench_startup_one "$DB_PROGRAM" "$base_count"
+	_bench_startup_one "$KV_PROGRAM" "$count"
+
+	_print_header "Request latency (one-shot CLI vs resident server)"
+	_bench_serve "$count"
+
+	_print_header "Selective range scan (100 keys)"
+	_bench_range "$count"
+
+	_print_header "Durable puts (fsyncs per operation)"
+	_bench_fsync 200
+
+	_print_header "Concurrent clients (95% 'g', 5% 'p')"
+	_bench_readers "$count"
+}
+
 # =============================================================================
 # MAIN ENTRY POINT
 # =============================================================================
@@ -291,6 +561,10 @@ case "$1" in
     "t"|"test")
 		_run_tests
         ;;
+
+    "b"|"bench")
+		_run_bench "$2" || exit 1
+        ;;
     "c"|"clean")
         echo "Cleaning up generated files..."
         rm -f "$DB_PROGRAM" "$DB_FILE" "$VALGRIND_LOG"